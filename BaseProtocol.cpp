@@ -19,8 +19,11 @@
 #include "Bus.h"
 #include "Crc.h"
 #include "BaseProtocol.h"
+#include "stats.hpp"
+#include "trace.hpp"
 
 uint8_t configuredAddress = INITIAL_ADDRESS;
+Stats stats = {};
 
 cmd_result handleCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen) {
 	if (maxLen < 5)
@@ -47,13 +50,17 @@ cmd_result handleCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dat
 			dataout[0] = MAX_PACKET_LENGTH >> 8;
 			dataout[1] = MAX_PACKET_LENGTH & 0xFF;
 			return cmd_ok(2);
-		default:
+		default: {
+			trace::Scope scope(trace::Event::command, cmd);
 			return processCommand(cmd, datain, len, dataout, maxLen);
+		}
 	}
 }
 
 
 int BusCallback(uint8_t address, uint8_t *data, uint8_t len, uint8_t maxLen) {
+	trace::Scope scope(trace::Event::bus, len > 0 ? data[0] : 0xffff);
+	stats.bytesReceived += len + 1;
 
 	// Check that there is at least room for an address, status, length and CRC
 	if (maxLen < 5)
@@ -62,6 +69,8 @@ int BusCallback(uint8_t address, uint8_t *data, uint8_t len, uint8_t maxLen) {
 	cmd_result res(0);
 	// Check we received at least command and crc
 	if (len < 3) {
+		if (address == BROADCAST_ADDRESS)
+			return 0;
 		res = cmd_result(Status::INVALID_TRANSFER);
 	} else {
 		uint16_t crc = Crc16Ibm().update(address).update(data, len - 2).get();
@@ -70,9 +79,21 @@ int BusCallback(uint8_t address, uint8_t *data, uint8_t len, uint8_t maxLen) {
 			// be sure that the message was really
 			// for us, some someone else might also
 			// reply).
+			++stats.crcErrors;
+			trace::log(trace::Event::crcError, len);
 			return 0;
 		} else {
-			// CRC checks out, process a command
+			// CRC checks out, so the master can talk at our baud rate
+			BusConfirmBaudRate();
+
+			// Every matching puppy processes a broadcast, so
+			// none of them may reply
+			if (address == BROADCAST_ADDRESS) {
+				processBroadcast(data[0], data + 1, len - 3);
+				return 0;
+			}
+
+			// Process a command
 			res = handleCommand(data[0], data + 1, len - 3, data + 3, maxLen - 5);
 			if (res.status == Status::NO_REPLY)
 				return 0;
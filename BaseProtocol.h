@@ -27,6 +27,7 @@ struct Status {
 	static const uint8_t INVALID_TRANSFER      = 0x03;
 	static const uint8_t INVALID_CRC           = 0x04;
 	static const uint8_t INVALID_ARGUMENTS     = 0x05;
+	static const uint8_t BUSY                  = 0x06;
 	// Never sent, used internally to indicate no status should be
 	// returned.
 	static const uint8_t NO_REPLY              = 0xff;
@@ -40,6 +41,11 @@ struct ProtocolCommands {
 	static const uint8_t GET_MAX_PACKET_LENGTH = 0x0c;
 };
 
+/// Frames to this address are taken by every puppy whose hardware type
+/// matches the first argument byte, and are never answered (see
+/// processBroadcast())
+const uint8_t BROADCAST_ADDRESS = 0xfe;
+
 struct cmd_result {
 	cmd_result(uint8_t status, uint8_t len = 0) : status(status), len(len) {}
 	uint8_t status;
@@ -51,6 +57,7 @@ inline cmd_result cmd_ok(uint8_t len = 0) {
 }
 
 cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen);
+void processBroadcast(uint8_t cmd, uint8_t *datain, uint8_t len);
 void resetSystem();
 
 inline uint8_t getConfiguredAddress()
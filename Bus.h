@@ -23,8 +23,40 @@
 
 static_assert(MAX_PACKET_LENGTH >= 32, "Protocol requires at least 32-byte packets");
 
+/// Rate after reset, and the one the master must use first
+const uint32_t BUS_DEFAULT_BAUD_RATE = 230400;
+const uint32_t BUS_MIN_BAUD_RATE = 9600;
+/// Time for the master to send a valid frame at a rate set with
+/// BusSetBaudRate(), before the previous rate is restored
+const uint32_t BUS_BAUD_FALLBACK_MS = 500;
+
+/// Silence that ends a frame, in bits: 3.5 characters at the default rate
+/// and the same time (but never less than 3.5 characters) at other rates
+inline uint32_t BusInterFrameBits(uint32_t baud) {
+	const uint32_t INTER_FRAME_US = 150;
+	uint32_t bits = (INTER_FRAME_US * baud + 1000000 - 1) / 1000000;
+	return bits < 35 ? 35 : bits;
+}
+
+#if defined(BUS_USE_INTERRUPTS)
+/// Receive ring of the interrupt driven driver. DMA keeps filling it while
+/// the main loop is busy (programming flash, hashing), the RX timeout/idle
+/// interrupt marks where each frame ends.
+const uint16_t BUS_RX_RING_SIZE = 1024;
+/// Complete frames the ring can hold besides the one being received. More
+/// frames arriving before BusUpdate() gets to them are dropped.
+const uint8_t BUS_RX_FRAMES = BUS_RX_RING_SIZE / (MAX_PACKET_LENGTH + 1) - 1;
+static_assert((BUS_RX_RING_SIZE & (BUS_RX_RING_SIZE - 1)) == 0, "Ring size must be a power of two");
+static_assert(BUS_RX_FRAMES >= 1, "Ring must hold at least two frames");
+#endif
+
 /**
  * @brief Pool UART, read and write messages.
+ *
+ * With BUS_USE_INTERRUPTS, receiving and transmitting happens in the
+ * background and this only hands received frames to BusCallback and
+ * starts transmitting the reply.
+ *
  * @return true if busy, false if idle
  */
 bool BusUpdate();
@@ -34,5 +66,23 @@ void BusSetDeviceAddress(uint8_t address);
 uint8_t BusGetDeviceAddress();
 void BusResetDeviceAddress();
 
+/**
+ * @brief Switch to another baud rate once the current reply is sent.
+ *
+ * Unless BusConfirmBaudRate() is called within BUS_BAUD_FALLBACK_MS of
+ * the switch, the previous rate is restored, so a master that cannot
+ * talk at the new rate can go on at the old one.
+ *
+ * @return false if the rate is not supported (nothing changes then)
+ */
+bool BusSetBaudRate(uint32_t baud);
+/// A valid frame was received, keep the current baud rate
+void BusConfirmBaudRate();
+#if defined(CLOCK_BOOST)
+/// The USART kernel clock changed (see ClockBoost()), re-derive the divisor
+/// of the current baud rate. Only call between a request and its reply.
+void BusClockChanged();
+#endif
+
 int BusCallback(uint8_t address, uint8_t *buffer, uint8_t len, uint8_t maxLen);
 #endif /* BUS_H_ */
@@ -28,22 +28,32 @@
 	const uint8_t INITIAL_ADDRESS = 0x00;
 #endif
 
+// WRITE_BUFFER_PAGES is the number of FLASH_ERASE_SIZE page buffers used
+// by the WRITE_FLASH commands. With 2, a full page is committed from the
+// main loop after the reply went out, while the next page arrives, which
+// needs a bus driver that receives in the background (BUS_USE_INTERRUPTS).
+// With 1, the page is committed before replying.
+
 #if defined(BOARD_TYPE_prusa_dwarf)
 	const uint8_t INFO_HW_TYPE = 42;
     const uint16_t MAX_PACKET_LENGTH = 255;
+    const uint8_t WRITE_BUFFER_PAGES = 1;
     #define SYSTEM_CORE_CLOCK 64000000
     #define NEEDS_ADDRESS_CHANGE 1
 #elif defined(BOARD_TYPE_prusa_modular_bed)
 	const uint8_t INFO_HW_TYPE = 43;
     const uint16_t MAX_PACKET_LENGTH = 255;
+    const uint8_t WRITE_BUFFER_PAGES = 1;
     #define SYSTEM_CORE_CLOCK 64000000
     #define NEEDS_ADDRESS_CHANGE 0
 #elif defined(BOARD_TYPE_prusa_xbuddy_extension)
 	const uint8_t INFO_HW_TYPE = 44;
     const uint16_t MAX_PACKET_LENGTH = 255;
+    const uint8_t WRITE_BUFFER_PAGES = 2;
 #elif defined(BOARD_TYPE_prusa_indx_head)
 	const uint8_t INFO_HW_TYPE = 45;
     const uint16_t MAX_PACKET_LENGTH = 255;
+    const uint8_t WRITE_BUFFER_PAGES = 2;
 #elif defined(BOARD_TYPE_prusa_baseboard)
     // Actual INFO_HW_TYPE is determined at runtime based on resistors
     // connected to the GPIO pins of the baseboard. This will be
@@ -55,13 +65,17 @@
     // - 51 left for old baseboard10(obsolete) with no ID pins grounded.
     const uint8_t INFO_HW_TYPE = 51;
     const uint16_t MAX_PACKET_LENGTH = 255;
+    const uint8_t WRITE_BUFFER_PAGES = 1;
     #define NEEDS_ADDRESS_CHANGE 0
 #elif defined(BOARD_TYPE_prusa_smartled01)
     const uint8_t INFO_HW_TYPE = 52;
     const uint16_t MAX_PACKET_LENGTH = 255;
+    const uint8_t WRITE_BUFFER_PAGES = 1;
     #define NEEDS_ADDRESS_CHANGE 0
 #else
 	#error "No board type defined"
 #endif
 
+static_assert(WRITE_BUFFER_PAGES == 1 || WRITE_BUFFER_PAGES == 2, "Single or double buffered page writes only");
+
 #endif /* CONFIG_H_ */
@@ -55,6 +55,52 @@
   }
 #endif
 
+// Faster equivalents of _crc16_update, see Crc.cpp for the tables
+extern const uint16_t crc16IbmNibbleTable[16];
+extern const uint16_t crc16IbmTable[256];
+
+inline uint16_t _crc16_update_nibble(uint16_t crc, uint8_t a) {
+  crc ^= a;
+  crc = (crc >> 4) ^ crc16IbmNibbleTable[crc & 0x0f];
+  crc = (crc >> 4) ^ crc16IbmNibbleTable[crc & 0x0f];
+  return crc;
+}
+
+inline uint16_t _crc16_update_table(uint16_t crc, uint8_t a) {
+  return (crc >> 8) ^ crc16IbmTable[(crc ^ a) & 0xff];
+}
+
+// Buffer versions of the above. The slicing-by-4 one takes four bytes per
+// step, using 1.5KiB of extra tables. The hardware one uses the CRC
+// peripheral (G0, C0 and H5), it is implemented by the backend.
+uint16_t crc16IbmUpdateSlice4(uint16_t crc, const uint8_t *buf, uint8_t len);
+uint16_t crc16IbmUpdateHw(uint16_t crc, const uint8_t *buf, uint8_t len);
+
+// CRC-32/MPEG-2 (polynomial 0x04C11DB7, initial value 0xffffffff, no
+// reflection) on the CRC peripheral, as preboot checks the bootloader.
+// The data is fed as little endian words, a partial last word padded
+// with 0xff. Implemented by the backend.
+uint32_t crc32Hw(const uint8_t *buf, uint32_t len);
+
+// The CRC peripheral calculates MSB first, with its input and output
+// reflected. So it continues from a (reflected) CRC value by loading
+// the reversed value into its INIT register.
+inline uint16_t crc16Reverse(uint16_t v) {
+  uint16_t r = 0;
+  for (uint8_t i = 0; i < 16; ++i) {
+    r = (r << 1) | (v & 1);
+    v >>= 1;
+  }
+  return r;
+}
+
+template <typename T, T Update(T, uint8_t)>
+T crcUpdateBytes(T crc, const uint8_t *buf, uint8_t len) {
+  for (uint8_t i = 0; i < len; ++i)
+    crc = Update(crc, buf[i]);
+  return crc;
+}
+
 /**
  * Helper class to calculate crcs for transfers. To use it, create an
  * instance, call update() for each byte and/or buffer of bytes to
@@ -62,8 +108,11 @@
  * update() is chainable, so you can do e.g.:
  *
  *   uint8_t crc = Crc<...>().update(first_byte).update(rest_of_bytes, len).get();
+ *
+ * UpdateBuffer is used for update() with a buffer, it defaults to
+ * calling Update for each byte.
  */
-template <typename T, T Update(T, uint8_t), T Initial>
+template <typename T, T Update(T, uint8_t), T Initial, T UpdateBuffer(T, const uint8_t *, uint8_t) = crcUpdateBytes<T, Update>>
 class Crc {
   public:
     Crc& update(uint8_t b) {
@@ -72,8 +121,7 @@ class Crc {
     }
 
     Crc& update(uint8_t *buf, uint8_t len) {
-      for (uint8_t i = 0; i < len; ++i)
-        this->update(buf[i]);
+      this->crc = UpdateBuffer(this->crc, buf, len);
       return *this;
     }
     T get() {
@@ -91,5 +139,31 @@ class Crc {
 
 using Crc8Ccitt = Crc<uint8_t, _crc8_ccitt_update, 0xff>;
 using Crc16Ccitt = Crc<uint16_t, _crc_ccitt_update, 0xffff>;
-// Called CRC16-IBM (or CRC16-ANSI or just CRC16) by wikipedia, used by ModBus
-using Crc16Ibm = Crc<uint16_t, _crc16_update, 0xffff>;
+// Called CRC16-IBM (or CRC16-ANSI or just CRC16) by wikipedia, used by ModBus.
+// All backends give the same result, they trade flash for speed:
+using Crc16IbmBitwise = Crc<uint16_t, _crc16_update, 0xffff>;                               ///< no tables
+using Crc16IbmNibble = Crc<uint16_t, _crc16_update_nibble, 0xffff>;                         ///< 32 B table
+using Crc16IbmTable = Crc<uint16_t, _crc16_update_table, 0xffff>;                           ///< 512 B table
+using Crc16IbmSlice4 = Crc<uint16_t, _crc16_update_table, 0xffff, crc16IbmUpdateSlice4>;    ///< 2 KiB tables
+using Crc16IbmHw = Crc<uint16_t, _crc16_update, 0xffff, crc16IbmUpdateHw>;                  ///< CRC peripheral
+
+// The one the bus uses, selected per board with -DCRC16_IBM_BACKEND=...
+#define CRC16_IBM_BITWISE 1
+#define CRC16_IBM_NIBBLE 2
+#define CRC16_IBM_TABLE 3
+#define CRC16_IBM_SLICE4 4
+#define CRC16_IBM_HW 5
+
+#if !defined(CRC16_IBM_BACKEND) || CRC16_IBM_BACKEND == CRC16_IBM_BITWISE
+using Crc16Ibm = Crc16IbmBitwise;
+#elif CRC16_IBM_BACKEND == CRC16_IBM_NIBBLE
+using Crc16Ibm = Crc16IbmNibble;
+#elif CRC16_IBM_BACKEND == CRC16_IBM_TABLE
+using Crc16Ibm = Crc16IbmTable;
+#elif CRC16_IBM_BACKEND == CRC16_IBM_SLICE4
+using Crc16Ibm = Crc16IbmSlice4;
+#elif CRC16_IBM_BACKEND == CRC16_IBM_HW
+using Crc16Ibm = Crc16IbmHw;
+#else
+#error "Unknown CRC16_IBM_BACKEND"
+#endif
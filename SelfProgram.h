@@ -20,37 +20,131 @@
 
 #include <stdint.h>
 #include "Config.h"
+#include "sha256.h"
+#include "crash_dump_shared.hpp"
 
 void startApplication();
 
+/**
+ * CRC-32 of the application for the boot check, in the last bytes of the
+ * firmware descriptor region, past FWDescriptor. pad_with_crc32.py
+ * --descriptor fills it in after the build, so crash_dump_shared.hpp (shared
+ * with the applications) stays as it is. Images without it leave whatever
+ * the linker put there, which hardly passes for a record with the guard and
+ * the inverted copy both matching.
+ */
+struct AppCrc {
+	uint32_t guard;          ///< APP_CRC_GUARD if set
+	uint32_t crc32;          ///< CRC-32/MPEG-2 of the application up to the descriptor region
+	uint32_t crc32Inverted;  ///< ~crc32
+};
+constexpr uint32_t APP_CRC_GUARD = 0x32435243;
+constexpr uint32_t APP_CRC_OFFSET = puppy_crash_dump::APP_DESCRIPTOR_OFFSET
+	+ puppy_crash_dump::APP_DESCRIPTOR_LENGTH - sizeof(AppCrc);
+/// The descriptor region lies inside the application on the parts with more
+/// flash than the G0, so the CRC ends before it rather than at the end
+constexpr uint32_t APP_CRC_SIZE = puppy_crash_dump::APP_DESCRIPTOR_OFFSET;
+static_assert(sizeof(puppy_crash_dump::FWDescriptor) <= APP_CRC_OFFSET - puppy_crash_dump::APP_DESCRIPTOR_OFFSET,
+	"AppCrc must not overlap FWDescriptor");
+static_assert(APP_CRC_OFFSET + sizeof(AppCrc) <= APPLICATION_SIZE, "AppCrc must be in the application");
+
 class SelfProgram {
 public:
 
 	/**
-	 * @brief Erase the whole application flash area
+	 * @brief Start rewriting the whole application, with the flash erased
+	 * sector by sector as the writes reach it.
 	 *
-	 * Called before writing the application to ensure that the flash is empty.
+	 * For flash that cannot erase single pages (STM32F4). Until
+	 * finishErasing(), eraseSectors() erases each sector on the first
+	 * write to it. Sectors that are blank already are not erased.
 	 *
 	 * Implementation is required only if used.
-	 *
+	 */
+	static void startErasing();
+
+	/**
+	 * @brief Erase the sectors in the given range that were not erased
+	 * since startErasing(). Does nothing without startErasing().
 	 * @return 0 on success, 1 on failure
 	 */
-	static uint8_t eraseApplicationFlash();
+	static uint8_t eraseSectors(uint32_t address, uint32_t len);
+
+	/**
+	 * @brief Erase the sectors no write reached since startErasing(), so
+	 * the application holds nothing but the new image.
+	 * @return 0 on success, 1 on failure
+	 */
+	static uint8_t finishErasing();
 
 	static void readFlash(uint32_t address, uint8_t *data, uint16_t len);
 
 	static uint8_t readByte(uint32_t address);
 
+	/**
+	 * @brief Erase the FLASH_ERASE_SIZE page that starts at address
+	 * @return 0 on success, an error code otherwise
+	 */
+	static uint8_t erasePage(uint32_t address);
+
+	/**
+	 * @brief Program data without erasing first.
+	 *
+	 * Programs whole programSize units, a partial last unit is padded
+	 * with 0xff. With programNeedsErased, the units must be erased.
+	 *
+	 * @param address start of a program unit
+	 * @param len at most FLASH_WRITE_SIZE bytes
+	 * @return 0 on success, an error code otherwise
+	 */
 	static uint8_t writePage(uint32_t address, uint8_t *data, uint16_t len);
 
+	/// Smallest unit the flash programs at once
+	static constexpr const uint16_t programSize = FLASH_PROGRAM_SIZE;
+
+	/// Whether a unit can only be programmed once after an erase (ECC
+	/// flash). Otherwise programming can still clear bits of a programmed
+	/// unit, so a unit only needs an erase if a bit has to go from 0 to 1.
+#if defined(STM32F4)
+	static constexpr const bool programNeedsErased = false;
+#else
+	static constexpr const bool programNeedsErased = true;
+#endif
+
 	/**
-	 * @brief Calculate salted fingerprint of the application.
+	 * @brief Start calculating the salted fingerprint of the application.
 	 * @param salt 4 B salt added before the application, in this situation 4 B salt should be enough
 	 * This fingerprint encompasses the entire application area.
 	 * It is used as proof of original puppy to buddy.
-	 * Result is stored in internal variables appFwFingerprintValid, appFwFingerprint and appFwFingerprintSalt.
+	 * The hashing is done by saltedFingerprintStep(), the result is
+	 * stored in internal variables appFwFingerprintValid,
+	 * appFwFingerprint and appFwFingerprintSalt. A running calculation
+	 * with the same salt just goes on.
 	 */
-	static void calculateSaltedFingerprint(uint32_t salt);
+	static void startSaltedFingerprint(uint32_t salt);
+
+	/**
+	 * @brief Hash the next saltedFingerprintStepSize bytes of the
+	 * salted fingerprint, if one is being calculated.
+	 * @return true if there was anything to do
+	 */
+	static bool saltedFingerprintStep();
+
+	/// True while saltedFingerprintStep() still has work to do
+	static bool saltedFingerprintRunning() { return saltedState == Salted::running; }
+	/// Application bytes the running salted fingerprint has hashed so far
+	static uint32_t saltedFingerprintProgress() { return saltedHashed; }
+
+	/// Bytes per saltedFingerprintStep(). The DMA driven bus receives
+	/// while hashing, so a step can be short enough for the main loop to
+	/// answer in between. A polled bus loses what arrives during any step
+	/// longer than a character, so it hashes everything in one go after
+	/// the reply went out instead.
+#if defined(BUS_USE_INTERRUPTS)
+	static constexpr const uint32_t saltedFingerprintStepSize = 1024;
+#else
+	static constexpr const uint32_t saltedFingerprintStepSize = APPLICATION_SIZE;
+#endif
 
 	/**
 	 * @brief Calculate static fingerprint of the application.
@@ -61,7 +155,90 @@ public:
 	 */
 	static bool checkUnsaltedFingerprint(const unsigned char fingerprint[32]);
 
+	/**
+	 * @brief Check the application up to the descriptor region with the
+	 * CRC peripheral (see crc32Hw()), a word per cycle instead of SHA-256.
+	 * @param crc check the app with this CRC-32
+	 * @return true to run the application, false if corruption is detected
+	 */
+	static bool checkImageCrc(uint32_t crc);
+
+	/**
+	 * @brief Check the application with checkImageCrc() if it carries an
+	 * AppCrc, with checkUnsaltedFingerprint() otherwise, unless
+	 * the verified boot record in the backup registers shows it passed
+	 * with this fingerprint before and the flash was not written since.
+	 * A passing check (re)writes the record.
+	 * @param fingerprint check the app with this fingerprint, unless it carries an AppCrc
+	 * @param full ignore the record, always check the application
+	 * @return true to run the application, false if corruption is detected
+	 */
+	static bool checkVerifiedFingerprint(const unsigned char fingerprint[32], bool full);
+
+	/**
+	 * @brief Advance the write generation, which invalidates the verified
+	 * boot record. Called by writePage(), erasePage() and
+	 * eraseSectors() before they touch the flash.
+	 */
+	static void nextWriteGeneration();
+
+	/**
+	 * @brief Advance the unsalted fingerprint over flash that now holds
+	 * its final content (just written, or found unchanged).
+	 *
+	 * Regions are expected in address order, starting at 0. Flash
+	 * skipped between two regions is hashed as it is. A region before
+	 * the hashed part is ignored, changing that part (see
+	 * pageHashesChanged()) discards the fingerprint.
+	 */
+	static void unsaltedFingerprintUpdate(uint32_t address, uint32_t len);
+
+	/**
+	 * @brief Complete the unsalted fingerprint after the last write.
+	 *
+	 * Hashes the rest of the application up to the descriptors, so
+	 * checkUnsaltedFingerprint() needs no pass over the whole
+	 * application.
+	 */
+	static void unsaltedFingerprintFinish();
+
+	/**
+	 * @brief Get nodes of the page hash tree.
+	 *
+	 * The leaves (level 0) are hashes of the FLASH_ERASE_SIZE pages of
+	 * the application, each node above is the hash of its two children
+	 * (or a copy of its only child, at the end of a level). All hashes
+	 * are SHA-256 truncated to pageHashSize bytes. This is meant to find
+	 * changed pages, not as proof of the content (use the fingerprint
+	 * for that).
+	 *
+	 * Leaves are cached until their page is written (see
+	 * pageHashesChanged()), so only changed pages are hashed again.
+	 *
+	 * @param level tree level, 0 for the pages
+	 * @param index first node in the level
+	 * @param count number of nodes, must all exist
+	 * @param output count * pageHashSize bytes
+	 */
+	static void getPageTreeHashes(uint8_t level, uint16_t index, uint8_t count, uint8_t *output);
+
+	/**
+	 * @brief Drop the cached hashes of the pages in the given range,
+	 * the unsalted fingerprint if it covers them, and a salted
+	 * fingerprint that is being calculated
+	 */
+	static void pageHashesChanged(uint32_t address, uint32_t len);
+
 	static constexpr const uint32_t applicationSize = APPLICATION_SIZE;
+	static constexpr const uint16_t pageCount = (APPLICATION_SIZE + FLASH_ERASE_SIZE - 1) / FLASH_ERASE_SIZE;
+	static constexpr const uint8_t pageHashSize = 8;
+
+	/**
+	 * @return number of nodes in the given level of the page hash tree
+	 */
+	static constexpr uint16_t pageTreeWidth(uint8_t level) {
+		return (pageCount + (1U << level) - 1) >> level;
+	}
 
 	static uint8_t eraseCount;
 	static bool appFwFingerprintValid;
@@ -69,7 +246,26 @@ public:
 	static uint32_t appFwFingerprintSalt;
 
 private:
-	static void calculateFingerprint(const uint32_t *salt_or_null, uint32_t size, unsigned char output[32]);
+	static void calculateFingerprint(const uint32_t *salt_or_null, uint32_t address, uint32_t size, unsigned char output[32]);
+	static void getPageTreeHash(uint8_t level, uint16_t index, uint8_t output[pageHashSize]);
+	static void hashPage(uint16_t page);
+	static void hashFlash(mbedtls_sha256_context *ctx, uint32_t address, uint32_t size);
+
+	static uint8_t pageHashes[pageCount][pageHashSize];
+	static uint8_t pageHashValid[(pageCount + 7) / 8];
+
+	/// Unsalted fingerprint built up by unsaltedFingerprintUpdate()
+	enum class Unsalted : uint8_t { none, running, done };
+	static Unsalted unsaltedState;
+	static uint32_t unsaltedHashed;	///< Application bytes in unsaltedContext
+	static mbedtls_sha256_context unsaltedContext;
+	static unsigned char unsaltedFingerprint[32];
+
+	/// Salted fingerprint calculated by saltedFingerprintStep()
+	enum class Salted : uint8_t { none, running };
+	static Salted saltedState;
+	static uint32_t saltedHashed;	///< Application bytes in saltedContext
+	static mbedtls_sha256_context saltedContext;
 };
 
 #endif /* SELFPROGRAM_H_ */
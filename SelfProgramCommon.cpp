@@ -1,8 +1,12 @@
 #include "SelfProgram.h"
 
 #include <cstring>
+#include "Crc.h"
 #include "sha256.h"
 #include "iwdg.hpp"
+#include "backup_registers.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
 uint8_t SelfProgram::eraseCount = 0;
 bool SelfProgram::appFwFingerprintValid = false;
@@ -10,6 +14,21 @@ bool SelfProgram::appFwFingerprintValid = false;
 unsigned char SelfProgram::appFwFingerprint[32] = {0};
 uint32_t SelfProgram::appFwFingerprintSalt = 0;
 
+uint8_t SelfProgram::pageHashes[pageCount][pageHashSize];
+uint8_t SelfProgram::pageHashValid[(pageCount + 7) / 8] = {0};
+
+SelfProgram::Unsalted SelfProgram::unsaltedState = SelfProgram::Unsalted::none;
+uint32_t SelfProgram::unsaltedHashed = 0;
+mbedtls_sha256_context SelfProgram::unsaltedContext;
+unsigned char SelfProgram::unsaltedFingerprint[32];
+
+SelfProgram::Salted SelfProgram::saltedState = SelfProgram::Salted::none;
+uint32_t SelfProgram::saltedHashed = 0;
+mbedtls_sha256_context SelfProgram::saltedContext;
+
+// The unsalted fingerprint covers the application without its descriptors
+static constexpr uint32_t unsaltedSize = SelfProgram::applicationSize - FW_DESCRIPTOR_SIZE;
+
 void SelfProgram::readFlash(uint32_t address, uint8_t *data, uint16_t len) {
 	for (uint8_t i=0; i < len; i++) {
 		data[i] = readByte(address + i);
@@ -21,7 +40,8 @@ uint8_t SelfProgram::readByte(uint32_t address) {
 	return *ptr;
 }
 
-void SelfProgram::calculateFingerprint(const uint32_t *salt_or_null, uint32_t size, unsigned char output[32]) {
+void SelfProgram::calculateFingerprint(const uint32_t *salt_or_null, uint32_t address, uint32_t size, unsigned char output[32]) {
+    trace::Scope scope(trace::Event::fingerprint, salt_or_null != nullptr);
     mbedtls_sha256_context ctx;
     mbedtls_sha256_init(&ctx);
     mbedtls_sha256_starts_ret(&ctx);
@@ -30,29 +50,213 @@ void SelfProgram::calculateFingerprint(const uint32_t *salt_or_null, uint32_t si
         mbedtls_sha256_update_ret(&ctx, reinterpret_cast<const uint8_t *>(salt_or_null), sizeof(*salt_or_null));
     }
 
+    hashFlash(&ctx, address, size);
+
+    mbedtls_sha256_finish_ret(&ctx, output);
+    mbedtls_sha256_free(&ctx);
+}
+
+void SelfProgram::hashFlash(mbedtls_sha256_context *ctx, uint32_t address, uint32_t size) {
+    trace::Scope scope(trace::Event::hash, size / 64);
+    const uint32_t start = trace::cycles();
     // Hash the firmware in chunks so we can kick the watchdog
     static constexpr size_t chunk = 1024;
-    const unsigned char *p = (const unsigned char *)(FLASH_BASE + FLASH_APP_OFFSET);
+    const unsigned char *p = (const unsigned char *)(FLASH_BASE + FLASH_APP_OFFSET + address);
     while (size > 0) {
         size_t n = size < chunk ? size : chunk;
-        mbedtls_sha256_update_ret(&ctx, p, n);
+        mbedtls_sha256_update_ret(ctx, p, n);
         WatchdogReset();
         p += n;
         size -= n;
     }
+    stats.hashCycles += trace::cycles() - start;
+}
 
-    mbedtls_sha256_finish_ret(&ctx, output);
-    mbedtls_sha256_free(&ctx);
+void SelfProgram::startSaltedFingerprint(uint32_t salt) {
+    if (saltedState == Salted::running) {
+        if (salt == appFwFingerprintSalt)
+            return;
+        mbedtls_sha256_free(&saltedContext);
+    }
+
+    appFwFingerprintSalt = salt;
+    appFwFingerprintValid = false;
+    mbedtls_sha256_init(&saltedContext);
+    mbedtls_sha256_starts_ret(&saltedContext);
+    mbedtls_sha256_update_ret(&saltedContext, reinterpret_cast<const uint8_t *>(&salt), sizeof(salt));
+    saltedHashed = 0;
+    saltedState = Salted::running;
 }
 
-void SelfProgram::calculateSaltedFingerprint(uint32_t salt) {
-    calculateFingerprint(&salt, applicationSize, appFwFingerprint);
-    appFwFingerprintValid = true;
+bool SelfProgram::saltedFingerprintStep() {
+    if (saltedState != Salted::running)
+        return false;
+
+    uint32_t n = applicationSize - saltedHashed;
+    if (n > saltedFingerprintStepSize)
+        n = saltedFingerprintStepSize;
+    hashFlash(&saltedContext, saltedHashed, n);
+    saltedHashed += n;
+
+    if (saltedHashed == applicationSize) {
+        mbedtls_sha256_finish_ret(&saltedContext, appFwFingerprint);
+        mbedtls_sha256_free(&saltedContext);
+        saltedState = Salted::none;
+        appFwFingerprintValid = true;
+    }
+    return true;
 }
 
 bool SelfProgram::checkUnsaltedFingerprint(const unsigned char fingerprint[32])
 {
+	if (unsaltedState == Unsalted::done)
+		return (memcmp(unsaltedFingerprint, fingerprint, sizeof(unsaltedFingerprint)) == 0);
+
 	unsigned char calculatedFingerprint[32];
-	calculateFingerprint(nullptr, applicationSize - FW_DESCRIPTOR_SIZE, calculatedFingerprint);
+	calculateFingerprint(nullptr, 0, unsaltedSize, calculatedFingerprint);
 	return (memcmp(calculatedFingerprint, fingerprint, sizeof(calculatedFingerprint)) == 0);
 }
+
+bool SelfProgram::checkImageCrc(uint32_t crc)
+{
+	const uint8_t *app = (const uint8_t *)(FLASH_BASE + FLASH_APP_OFFSET);
+	return crc32Hw(app, APP_CRC_SIZE) == crc;
+}
+
+// Verified boot record: the write generation, and the first bytes of the
+// fingerprint the application last passed the unsalted check with (8, or
+// 4 where the family has fewer backup registers to spare), valid while
+// its tag matches the write generation
+enum BackupRegister : uint8_t {
+    BACKUP_WRITE_GENERATION,
+    BACKUP_VERIFIED_TAG,
+    BACKUP_VERIFIED_FINGERPRINT,    ///< and the ones after it
+};
+static constexpr uint8_t verifiedWords = BACKUP_REGISTER_COUNT - BACKUP_VERIFIED_FINGERPRINT;
+static_assert(verifiedWords >= 1 && verifiedWords <= 2, "Verified boot record does not fit");
+static constexpr uint32_t verifiedMagic = 0x56455246;
+
+void SelfProgram::nextWriteGeneration() {
+    write_backup_register(BACKUP_WRITE_GENERATION, read_backup_register(BACKUP_WRITE_GENERATION) + 1);
+}
+
+bool SelfProgram::checkVerifiedFingerprint(const unsigned char fingerprint[32], bool full) {
+    uint32_t words[verifiedWords];
+    memcpy(words, fingerprint, sizeof(words));
+    const uint32_t tag = read_backup_register(BACKUP_WRITE_GENERATION) ^ verifiedMagic;
+
+    bool recorded = !full && read_backup_register(BACKUP_VERIFIED_TAG) == tag;
+    for (uint8_t i = 0; i < verifiedWords && recorded; ++i)
+        recorded = read_backup_register(BACKUP_VERIFIED_FINGERPRINT + i) == words[i];
+    if (recorded)
+        return true;
+
+    // The tag goes last, so a reset in between leaves no record
+    write_backup_register(BACKUP_VERIFIED_TAG, ~tag);
+    // The SHA-256 of the fingerprint stays for attestation (see
+    // COMPUTE_FINGERPRINT), the CRC-32 is enough against corruption
+    const AppCrc *crc = (const AppCrc *)(FLASH_BASE + FLASH_APP_OFFSET + APP_CRC_OFFSET);
+    const bool passed = crc->guard == APP_CRC_GUARD && crc->crc32 == ~crc->crc32Inverted
+        ? checkImageCrc(crc->crc32) : checkUnsaltedFingerprint(fingerprint);
+    if (!passed)
+        return false;
+    for (uint8_t i = 0; i < verifiedWords; ++i)
+        write_backup_register(BACKUP_VERIFIED_FINGERPRINT + i, words[i]);
+    write_backup_register(BACKUP_VERIFIED_TAG, tag);
+    return true;
+}
+
+void SelfProgram::unsaltedFingerprintUpdate(uint32_t address, uint32_t len) {
+    if (unsaltedState == Unsalted::none) {
+        // Only an upload from the start, not an empty FINALIZE_FLASH
+        if (address != 0 || len == 0)
+            return;
+        mbedtls_sha256_init(&unsaltedContext);
+        mbedtls_sha256_starts_ret(&unsaltedContext);
+        unsaltedHashed = 0;
+        unsaltedState = Unsalted::running;
+    }
+    if (unsaltedState != Unsalted::running)
+        return;
+
+    // Anything skipped since the last region is hashed from flash too
+    uint32_t end = address + len < unsaltedSize ? address + len : unsaltedSize;
+    if (end > unsaltedHashed) {
+        hashFlash(&unsaltedContext, unsaltedHashed, end - unsaltedHashed);
+        unsaltedHashed = end;
+    }
+}
+
+void SelfProgram::unsaltedFingerprintFinish() {
+    if (unsaltedState != Unsalted::running)
+        return;
+    hashFlash(&unsaltedContext, unsaltedHashed, unsaltedSize - unsaltedHashed);
+    mbedtls_sha256_finish_ret(&unsaltedContext, unsaltedFingerprint);
+    mbedtls_sha256_free(&unsaltedContext);
+    unsaltedState = Unsalted::done;
+}
+
+// Kept out of getPageTreeHash(), so the recursion does not carry a
+// hash context and digest per level on the stack
+__attribute__((noinline)) void SelfProgram::hashPage(uint16_t page) {
+    unsigned char hash[32];
+    uint32_t address = (uint32_t)page * FLASH_ERASE_SIZE;
+    uint32_t size = applicationSize - address < FLASH_ERASE_SIZE ? applicationSize - address : FLASH_ERASE_SIZE;
+    calculateFingerprint(nullptr, address, size, hash);
+    memcpy(pageHashes[page], hash, pageHashSize);
+    pageHashValid[page / 8] |= 1 << page % 8;
+}
+
+__attribute__((noinline)) static void hashChildren(const uint8_t *children, uint8_t *output) {
+    unsigned char hash[32];
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts_ret(&ctx);
+    mbedtls_sha256_update_ret(&ctx, children, 2 * SelfProgram::pageHashSize);
+    mbedtls_sha256_finish_ret(&ctx, hash);
+    mbedtls_sha256_free(&ctx);
+    memcpy(output, hash, SelfProgram::pageHashSize);
+}
+
+void SelfProgram::getPageTreeHash(uint8_t level, uint16_t index, uint8_t output[pageHashSize]) {
+    if (level == 0) {
+        if (!(pageHashValid[index / 8] & (1 << index % 8)))
+            hashPage(index);
+        memcpy(output, pageHashes[index], pageHashSize);
+        return;
+    }
+
+    // A node without right sibling is just moved up
+    if (2 * index + 1 >= pageTreeWidth(level - 1)) {
+        getPageTreeHash(level - 1, 2 * index, output);
+        return;
+    }
+
+    uint8_t children[2 * pageHashSize];
+    getPageTreeHash(level - 1, 2 * index, children);
+    getPageTreeHash(level - 1, 2 * index + 1, children + pageHashSize);
+    hashChildren(children, output);
+}
+
+void SelfProgram::getPageTreeHashes(uint8_t level, uint16_t index, uint8_t count, uint8_t *output) {
+    while (count > 0) {
+        getPageTreeHash(level, index, output);
+        output += pageHashSize;
+        ++index;
+        --count;
+    }
+}
+
+void SelfProgram::pageHashesChanged(uint32_t address, uint32_t len) {
+    if (len == 0)
+        return;
+    if (unsaltedState == Unsalted::done || (unsaltedState == Unsalted::running && address < unsaltedHashed))
+        unsaltedState = Unsalted::none;
+    if (saltedState == Salted::running) {
+        mbedtls_sha256_free(&saltedContext);
+        saltedState = Salted::none;
+    }
+    appFwFingerprintValid = false;
+    for (uint32_t page = address / FLASH_ERASE_SIZE; page <= (address + len - 1) / FLASH_ERASE_SIZE && page < pageCount; ++page)
+        pageHashValid[page / 8] &= ~(1 << page % 8);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdint>
+/**
+ * @brief What the bootloader leaves for the application at the start of RAM
+ * (the .app_args section). Should be the same in the applications reading it,
+ * before their own startup code clears that RAM.
+ */
+
+/// Time the last boot spent in each phase of the bootloader, in
+/// microseconds, so the application can report it and boards can be held
+/// to a boot time budget. A phase that did not run is 0.
+struct __attribute__((packed)) BootProfile {
+    uint32_t clock_init;        ///< ClockInit(), 0 where the cycle counter needs it (STM32C0)
+    uint32_t bus_init;          ///< BusInit()
+    uint32_t watchdog_start;    ///< WatchdogStart()
+    uint32_t power_panic;       ///< WaitForEndOfPowerPanic()
+    uint32_t led;               ///< led::set_rgb() calls
+    uint32_t first_frame;       ///< From the main loop until the first frame was handled
+    uint32_t fingerprint_check; ///< Checking the unsalted fingerprint (or CRC-32) before the start
+    uint32_t deinit;            ///< Preparing the start of the application
+    uint32_t total;             ///< From reset (after ClockInit() on STM32C0) to the start
+};
+
+struct __attribute__((packed)) ApplicationStartupArguments {
+    uint8_t modbus_address;
+    uint8_t boot_profile_size;  ///< sizeof(BootProfile), older bootloaders leave this byte undefined
+    BootProfile boot_profile;
+};
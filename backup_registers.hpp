@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+
+/// Backup domain words the bootloader keeps its verified boot record in
+/// (see SelfProgram::checkVerifiedFingerprint()). They survive a system
+/// reset, but not a power cycle. Each family maps them to its last
+/// backup registers, so the application can keep using the first ones.
+/// The C0 has only four, so the record takes three there and leaves
+/// PWR_BKP0R to the application.
+#if defined(STM32C0)
+static constexpr uint8_t BACKUP_REGISTER_COUNT = 3;
+#else
+static constexpr uint8_t BACKUP_REGISTER_COUNT = 4;
+#endif
+
+/// Read backup register `index` (0 to BACKUP_REGISTER_COUNT - 1)
+uint32_t read_backup_register(uint8_t index);
+
+/// Write backup register `index` (0 to BACKUP_REGISTER_COUNT - 1)
+void write_backup_register(uint8_t index, uint32_t value);
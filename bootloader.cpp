@@ -21,10 +21,14 @@
 #include "Config.h"
 #include "Bus.h"
 #include "BaseProtocol.h"
+#include "Crc.h"
 #include "SelfProgram.h"
 #include "bootloader.h"
+#include "stats.hpp"
+#include "trace.hpp"
 #include "led.hpp"
 #include "crash_dump_shared.hpp"
+#include "app_args_shared.hpp"
 #include "otp.hpp"
 #include "power_panic.hpp"
 #include "rtt.hpp"
@@ -44,6 +48,13 @@ struct Commands {
 	static const uint8_t GET_FINGERPRINT       = 0x0e;
 	static const uint8_t COMPUTE_FINGERPRINT   = 0x0f;
 	static const uint8_t READ_OTP              = 0x10;
+	static const uint8_t WRITE_FLASH_STREAM    = 0x11;
+	static const uint8_t WRITE_FLASH_LZ4       = 0x12;
+	static const uint8_t WRITE_FLASH_DELTA     = 0x13;
+	static const uint8_t GET_PAGE_HASHES       = 0x14;
+	static const uint8_t SET_BAUD              = 0x15;
+	static const uint8_t GET_WRITE_STATUS      = 0x16;
+	static const uint8_t GET_STATS             = 0x17;
 
 	// These were removed and should not be used
 	static const uint8_t RESERVED_02 = 0x02; ///< POWER_UP_DISPLAY
@@ -72,12 +83,10 @@ constexpr const struct VersionInfoInFlash version_info __attribute__((__section_
 
 uint8_t info_hw_type{INFO_HW_TYPE};
 
-struct __attribute__((packed)) ApplicationStartupArguments {
-    uint8_t modbus_address;
-};
-
 struct ApplicationStartupArguments application_startup_arguments __attribute__((__section__(".app_args"), __used__)) = {
     .modbus_address = 0xFF,
+    .boot_profile_size = sizeof(BootProfile),
+    .boot_profile = {},
 };
 
 // Check that the version info size used by the linker (which must be
@@ -89,13 +98,35 @@ static_assert(sizeof(version_info) == VERSION_SIZE, "Version section has wrong s
 // or get salt and fingerprint from buddy
 volatile bool bootloaderExit = false;	///< Exit with check of the internal fingerprint
 volatile bool bootloaderFingerprintMatch = false;	///< True if fingerprint was checked by buddy
+volatile bool bootloaderFullCheck = false;	///< Hash the application even if the verified boot record says it passed
+
+// START_APPLICATION flags, in the optional byte without fingerprint
+static const uint8_t START_FULL_CHECK = 0x01;	///< Set bootloaderFullCheck
 
 // Note that we must buffer a full erase page size (not smaller), since
 // we must know at the start of an erase page whether any byte in the
 // entire page is changed to decide whether or not to erase.
-static uint8_t writeBuffer[FLASH_ERASE_SIZE];
+static uint8_t pageBuffers[WRITE_BUFFER_PAGES][FLASH_ERASE_SIZE];
+static uint8_t *writeBuffer = pageBuffers[0];	///< Page being assembled
 static uint32_t nextWriteAddress = 0;
 
+// With WRITE_BUFFER_PAGES == 2, a full page waits here for the main loop
+// to commit it, while the next one is assembled in the other buffer
+static uint8_t *pendingBuffer = nullptr;
+static uint32_t pendingAddress = 0;
+static uint8_t commitError = 0;	///< First error of a deferred commit, reported by the next write
+
+// Error of a page that reads back different from what was programmed.
+// The upload then goes back to the start of that page, so the master
+// only has to send the page again (see writeFailed()).
+static const uint8_t VERIFY_FAILED = 0x0f;
+static uint32_t verifyFailedPage = UINT32_MAX;	///< Where writeFailed() takes the upload back to, UINT32_MAX if nowhere
+
+// State of preErasePage()
+static uint32_t preEraseChecked = 0;	///< The page being assembled needs no erase for the data before this
+static uint32_t preErasedPage = UINT32_MAX;	///< Page erased by preErasePage() ahead of its commit
+static bool deltaUpload = false;	///< WRITE_FLASH_DELTA may still copy from the page being assembled
+
 // Helper function that is declared but not defined, to allow
 // semi-static assertions (where input to a check is not really const,
 // but can be derived by the optimizer, so if the check passes, the call
@@ -106,10 +137,10 @@ void compiletime_check_failed();
 // Disable compile-time check (doesn't work on gcc 7 without LTO)
 void compiletime_check_failed() {}
 
-static bool equalToFlash(uint32_t address, uint16_t len) {
+static bool equalToFlash(const uint8_t *buffer, uint32_t address, uint16_t len) {
 	uint16_t offset = 0;
 	while (len > 0) {
-		if (writeBuffer[offset] != SelfProgram::readByte(address + offset))
+		if (buffer[offset] != SelfProgram::readByte(address + offset))
 			return false;
 		--len;
 		++offset;
@@ -118,65 +149,612 @@ static bool equalToFlash(uint32_t address, uint16_t len) {
 }
 
 
-static uint8_t commitToFlash(uint32_t address, uint16_t len) {
-	if (equalToFlash(address, len))
+// Whether the program unit at address can take the len bytes of data
+// without an erase. ECC flash needs the whole unit erased, other flash
+// just must not need any bit to go from 0 to 1.
+static bool programmable(const uint8_t *data, uint32_t address, uint16_t len) {
+	for (uint16_t i = 0; i < SelfProgram::programSize; ++i) {
+		uint8_t old = SelfProgram::readByte(address + i);
+		if (SelfProgram::programNeedsErased) {
+			if (old != 0xff)
+				return false;
+		} else if (i < len && (old & data[i]) != data[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Length of the next program unit at offset of a page of len bytes
+static uint16_t unitLength(uint16_t offset, uint16_t len) {
+	return len - offset < SelfProgram::programSize ? len - offset : SelfProgram::programSize;
+}
+
+// Store value big endian in size bytes at out, returns the byte after
+static uint8_t *putBigEndian(uint8_t *out, uint64_t value, uint8_t size) {
+	for (uint8_t i = size; i-- > 0; value >>= 8)
+		out[i] = value;
+	return out + size;
+}
+
+// Erase the page at address, traced and counted for FINALIZE_FLASH and
+// GET_STATS
+static uint8_t erasePage(uint32_t address) {
+	trace::Scope scope(trace::Event::erase, address / FLASH_ERASE_SIZE);
+	const uint32_t start = trace::cycles();
+	uint8_t err = SelfProgram::erasePage(address);
+	stats.eraseCycles += trace::cycles() - start;
+	if (err)
+		return err;
+	++stats.pagesErased;
+	if (SelfProgram::eraseCount < 0xff)
+		++SelfProgram::eraseCount;
+	return 0;
+}
+
+// Program part of a page, traced and counted for GET_STATS
+static uint8_t programPage(uint32_t address, uint8_t *data, uint16_t len) {
+	trace::Scope scope(trace::Event::program, address / FLASH_ERASE_SIZE);
+	const uint32_t start = trace::cycles();
+	uint8_t err = SelfProgram::writePage(address, data, len);
+	stats.programCycles += trace::cycles() - start;
+	return err;
+}
+
+// Write the page at address (erase page aligned, len up to
+// FLASH_ERASE_SIZE). Only the program units that differ from the flash
+// are programmed, and the page is only erased if one of them cannot be
+// programmed over what the flash holds.
+static uint8_t commitToFlash(uint8_t *buffer, uint32_t address, uint16_t len) {
+	trace::Scope scope(trace::Event::commit, address / FLASH_ERASE_SIZE);
+	stats.bytesCommitted += len;
+#ifdef STM32F4
+	// A sector is erased on the first write to it (see startErasing())
+	uint8_t err = SelfProgram::eraseSectors(address, len);
+	if (err)
+		return err;
+#endif
+
+	bool changed = false;
+	bool erase = false;
+	for (uint16_t offset = 0; offset < len && !erase; offset += SelfProgram::programSize) {
+		const uint16_t unitLen = unitLength(offset, len);
+		if (equalToFlash(&buffer[offset], address + offset, unitLen))
+			continue;
+		changed = true;
+		erase = !programmable(&buffer[offset], address + offset, unitLen);
+	}
+
+	// Either way, the flash now holds the page as uploaded, so the
+	// unsalted fingerprint can go on over it
+	if (!changed) {
+		++stats.pagesSkipped;
+		SelfProgram::unsaltedFingerprintUpdate(address, len);
 		return 0;
+	}
+
+	SelfProgram::pageHashesChanged(address, len);
 
+	if (erase) {
+		uint8_t err = erasePage(address);
+		if (err)
+			return err;
+	}
+
+	// Program each run of differing units, in pieces of up to
+	// FLASH_WRITE_SIZE. After an erase, this skips units of all 0xff.
 	uint16_t offset = 0;
-	while (len > 0) {
-		uint16_t pageLen = len < FLASH_WRITE_SIZE ? len : FLASH_WRITE_SIZE;
-		uint8_t err = SelfProgram::writePage(address + offset, &writeBuffer[offset], pageLen);
+	while (offset < len) {
+		if (equalToFlash(&buffer[offset], address + offset, unitLength(offset, len))) {
+			offset += SelfProgram::programSize;
+			continue;
+		}
+		const uint16_t start = offset;
+		do {
+			offset += unitLength(offset, len);
+		} while (offset < len && offset - start < FLASH_WRITE_SIZE
+				&& !equalToFlash(&buffer[offset], address + offset, unitLength(offset, len)));
+		uint8_t err = programPage(address + start, &buffer[start], offset - start);
 		if (err)
 			return err;
-		len -= pageLen;
-		offset += pageLen;
 	}
+
+#if defined(FLASH_VERIFY)
+	// Read the page back through the CRC unit, much faster than the
+	// fingerprint, which would only find a bad page after the upload
+	const uint8_t *flash = reinterpret_cast<const uint8_t *>(FLASH_BASE + FLASH_APP_OFFSET + address);
+	if (crc32Hw(flash, len) != crc32Hw(buffer, len)) {
+		trace::log(trace::Event::verifyFailed, address);
+#ifdef STM32F4
+		// Sending the page again would need the sector erased, and with
+		// it the pages written before this one, so the upload starts over
+		return 1;
+#else
+		verifyFailedPage = address;
+		return VERIFY_FAILED;
+#endif
+	}
+#endif
+
+	SelfProgram::unsaltedFingerprintUpdate(address, len);
 	return 0;
 }
 
+// Commit the page left by appendToPage(), if any
+static void commitPendingPage() {
+	if (!pendingBuffer)
+		return;
+	uint8_t err = commitToFlash(pendingBuffer, pendingAddress, FLASH_ERASE_SIZE);
+	if (err && !commitError)
+		commitError = err;
+	pendingBuffer = nullptr;
+}
+
+// Erase the page being assembled as soon as the data received for it
+// shows that commitToFlash() will have to, so the erase runs while the
+// rest of the page arrives. Called from the main loop, only with a bus
+// driver that receives in the background. Never erases on speculation:
+// a page that turns out equal to the flash is left alone, and
+// commitToFlash() just finds an erased page otherwise.
+static void preErasePage() {
+	if (WRITE_BUFFER_PAGES == 1 || deltaUpload)
+		return;
+
+	const uint32_t pageAddress = nextWriteAddress - nextWriteAddress % FLASH_ERASE_SIZE;
+	if (pageAddress == preErasedPage)
+		return;
+	// A new page, or the master started over
+	if (preEraseChecked < pageAddress || preEraseChecked > nextWriteAddress)
+		preEraseChecked = pageAddress;
+
+	while (preEraseChecked + SelfProgram::programSize <= nextWriteAddress) {
+		const uint8_t *data = &writeBuffer[preEraseChecked % FLASH_ERASE_SIZE];
+		if (!equalToFlash(data, preEraseChecked, SelfProgram::programSize)
+			&& !programmable(data, preEraseChecked, SelfProgram::programSize)) {
+			SelfProgram::pageHashesChanged(pageAddress, FLASH_ERASE_SIZE);
+			uint8_t err = erasePage(pageAddress);
+			if (err && !commitError)
+				commitError = err;
+			preErasedPage = pageAddress;
+			return;
+		}
+		preEraseChecked += SelfProgram::programSize;
+	}
+}
+
+// Error of a deferred commit since the last call, if any
+static uint8_t takeCommitError() {
+	uint8_t err = commitError;
+	commitError = 0;
+	return err;
+}
+
+// Reply of a write that failed with err: the reason (1), and after
+// VERIFY_FAILED the address the upload continues at (4). The first report
+// of a failed verification takes the upload back to that page.
+static cmd_result writeFailed(uint8_t err, uint8_t *dataout) {
+	dataout[0] = err;
+	if (err != VERIFY_FAILED)
+		return cmd_result(Status::COMMAND_FAILED, 1);
+	if (verifyFailedPage != UINT32_MAX) {
+		nextWriteAddress = verifyFailedPage;
+		verifyFailedPage = UINT32_MAX;
+	}
+	dataout[1] = nextWriteAddress >> 24;
+	dataout[2] = nextWriteAddress >> 16;
+	dataout[3] = nextWriteAddress >> 8;
+	dataout[4] = nextWriteAddress;
+	return cmd_result(Status::COMMAND_FAILED, 5);
+}
+
+// Add a byte at nextWriteAddress, committing the page when it is full
+static uint8_t appendToPage(uint8_t data) {
+	writeBuffer[nextWriteAddress % FLASH_ERASE_SIZE] = data;
+	++nextWriteAddress;
+	if (nextWriteAddress % FLASH_ERASE_SIZE != 0)
+		return 0;
+
+	const uint32_t pageAddress = nextWriteAddress - FLASH_ERASE_SIZE;
+	if (WRITE_BUFFER_PAGES == 1)
+		return commitToFlash(writeBuffer, pageAddress, FLASH_ERASE_SIZE);
+
+	// Leave the page to the main loop and continue in the other buffer.
+	// Only if the main loop did not get to the previous page yet (frames
+	// kept coming), it has to be committed now.
+	commitPendingPage();
+	if (commitError == VERIFY_FAILED)
+		return takeCommitError();	// The upload goes back to the previous page
+	pendingBuffer = writeBuffer;
+	pendingAddress = pageAddress;
+	writeBuffer = writeBuffer == pageBuffers[0] ? pageBuffers[WRITE_BUFFER_PAGES - 1] : pageBuffers[0];
+	return takeCommitError();
+}
+
 static cmd_result handleWriteFlash(uint32_t address, uint8_t *data, uint16_t len, uint8_t *dataout) {
+	// First, as the upload may have gone back to a page that failed
+	// verification, which a skip to another page must not hide
+	uint8_t err = takeCommitError();
+	if (err)
+		return writeFailed(err, dataout);
 
 #ifdef STM32F4
 	// Anyone using STM32F427 or similar will want to avoid writing full 2MB- 16kB of flash. This allows
 	// non-contiguous writes to the flash, but it's necessary to erase the application flash first!
-	// Erasing whole application flash takes some time(~30s) but after that, the writes are fast.
+	// Erasing whole application flash takes some time(~30s), so each sector is erased when the
+	// writes first reach it instead, and FINALIZE_FLASH erases the ones they skipped.
 	if(address == 0) {
-		// Erase the application flash area
-		if (SelfProgram::eraseApplicationFlash() != 0) {
-			dataout[0] = 1;
-			return cmd_result(Status::COMMAND_FAILED, 1);
-		}
+		SelfProgram::pageHashesChanged(0, SelfProgram::applicationSize);
+		SelfProgram::startErasing();
 	}
 
-	// This guarantees that writes are aligned to the erase page size(==sizeof(writeBuffer))
-	if (address % sizeof(writeBuffer) == 0)
+	// This guarantees that writes are aligned to the erase page size(==FLASH_ERASE_SIZE)
+	if (address % FLASH_ERASE_SIZE == 0)
 		nextWriteAddress = address;
 #else
-	// Only consecutive writes are supported
-	if(address == 0) {
+	// Writes are consecutive, except that the master may skip to the
+	// start of any page once the previous one is complete (to upload
+	// only changed pages, see GET_PAGE_HASHES)
+	if(address == 0 || (address % FLASH_ERASE_SIZE == 0 && nextWriteAddress % FLASH_ERASE_SIZE == 0)) {
 		nextWriteAddress = address;
 	}
+	if (address == 0)
+		deltaUpload = false;
 #endif // STM32F4
 
 	if (address != nextWriteAddress)
 		return cmd_result(Status::INVALID_ARGUMENTS);
 
-	nextWriteAddress += len;
-	while (address < nextWriteAddress) {
-		writeBuffer[address % sizeof(writeBuffer)] = *data;
+	while (len > 0) {
+		err = appendToPage(*data);
+		if (err)
+			return writeFailed(err, dataout);
 		++data;
-		++address;
+		--len;
+	}
 
-		if (address % sizeof(writeBuffer) == 0) {
-			uint8_t err = commitToFlash(address - sizeof(writeBuffer), sizeof(writeBuffer));
-			if (err) {
-				dataout[0] = err;
-				return cmd_result(Status::COMMAND_FAILED, 1);
+	return cmd_ok();
+}
+
+// State of WRITE_FLASH_STREAM between two acknowledgements, and of
+// broadcast WRITE_FLASH until GET_WRITE_STATUS
+static bool streamGap = false;	///< A frame was skipped, later frames are dropped until the master rewinds
+static uint8_t streamError = 0;	///< First flash error, reported with the next acknowledgement
+
+// Write a frame that gets no reply of its own: data that does not continue
+// at nextWriteAddress is dropped, errors are kept for the acknowledgement
+static void writeUnacknowledged(uint32_t address, uint8_t *data, uint8_t len) {
+	if (len > 0 && (address == 0 || address == nextWriteAddress)) {
+		if (address == 0) {
+			streamGap = false;
+			streamError = 0;
+		}
+		uint8_t reply[5];
+		cmd_result res = handleWriteFlash(address, data, len, reply);
+		if (res.status == Status::COMMAND_FAILED && !streamError)
+			streamError = reply[0];
+	} else if (address > nextWriteAddress) {
+		streamGap = true;
+	}
+	// else: a duplicate of data already received, ignore it
+}
+
+/**
+ * @brief Windowed variant of WRITE_FLASH.
+ *
+ * The master sends a window of frames back to back, and only the last
+ * one asks for an acknowledgement. Frames that do not continue at
+ * nextWriteAddress are dropped (a frame before them was lost, e.g. to a
+ * CRC error), so the acknowledgement carries the first missing offset
+ * and the master resumes from there (go-back-N).
+ *
+ * Request: seq (1), flags (1), address (4), data (0+)
+ * Reply (only with STREAM_ACK): seq (1), nack (1), next address (4), window (2)
+ */
+static cmd_result handleWriteFlashStream(uint8_t *datain, uint8_t len, uint8_t *dataout) {
+	static const uint8_t STREAM_ACK = 0x01;
+
+	if (len < 6)
+		return cmd_result(Status::INVALID_ARGUMENTS);
+
+	uint8_t seq = datain[0];
+	uint8_t flags = datain[1];
+	uint32_t address = datain[2] << 24 | datain[3] << 16 | datain[4] << 8 | datain[5];
+
+	// A frame without data only asks for the acknowledgement
+	writeUnacknowledged(address, datain + 6, len - 6);
+
+	if (!(flags & STREAM_ACK))
+		return cmd_result(Status::NO_REPLY);
+
+	if (streamError) {
+		uint8_t err = streamError;
+		streamError = 0;
+		return writeFailed(err, dataout);
+	}
+
+	const size_t ack_size = 8;
+	dataout[0] = seq;
+	dataout[1] = streamGap;
+	dataout[2] = nextWriteAddress >> 24;
+	dataout[3] = nextWriteAddress >> 16;
+	dataout[4] = nextWriteAddress >> 8;
+	dataout[5] = nextWriteAddress;
+	// Window size that makes the acknowledged frame the one that commits
+	// a page, so flash is only busy while the master waits for a reply
+	dataout[6] = FLASH_ERASE_SIZE >> 8;
+	dataout[7] = FLASH_ERASE_SIZE & 0xFF;
+	streamGap = false;
+	return cmd_ok(ack_size);
+}
+
+/**
+ * @brief Process a frame sent to BROADCAST_ADDRESS.
+ *
+ * Lets the master program all puppies of one hardware type at once. The
+ * first argument byte is the hardware type, frames for other types are
+ * ignored (there is no wildcard, an image only fits one type).
+ *
+ * Only WRITE_FLASH is accepted. It is written like a WRITE_FLASH_STREAM
+ * frame without acknowledgement, so a puppy that missed a frame drops
+ * the ones after it. The master then asks each puppy individually with
+ * GET_WRITE_STATUS and sends the rest to those that fell behind. Nothing
+ * paces the frames, so the master must leave each puppy the time to
+ * commit a page, e.g. by querying them at page boundaries.
+ *
+ * Request: hardware type (1), then as for WRITE_FLASH: address (4), data (0+)
+ */
+void processBroadcast(uint8_t cmd, uint8_t *datain, uint8_t len) {
+	if (len < 1 || datain[0] != info_hw_type)
+		return;
+	++datain;
+	--len;
+
+	switch (cmd) {
+		case Commands::WRITE_FLASH: {
+			if (len < 4)
+				return;
+
+			uint32_t address = datain[0] << 24 | datain[1] << 16 | datain[2] << 8 | datain[3];
+			writeUnacknowledged(address, datain + 4, len - 4);
+			return;
+		}
+	}
+}
+
+// Reply of WRITE_FLASH_LZ4 and WRITE_FLASH_DELTA: next address (4), page size (2)
+static cmd_result writeProgress(uint8_t *dataout) {
+	const size_t reply_size = 6;
+	dataout[0] = nextWriteAddress >> 24;
+	dataout[1] = nextWriteAddress >> 16;
+	dataout[2] = nextWriteAddress >> 8;
+	dataout[3] = nextWriteAddress;
+	dataout[4] = FLASH_ERASE_SIZE >> 8;
+	dataout[5] = FLASH_ERASE_SIZE & 0xFF;
+	return cmd_ok(reply_size);
+}
+
+// Byte written `distance` bytes before nextWriteAddress, from the page
+// buffers if it is part of the current or the pending page, from flash
+// otherwise
+static uint8_t readBack(uint16_t distance) {
+	uint32_t address = nextWriteAddress - distance;
+	if (address >= nextWriteAddress - nextWriteAddress % FLASH_ERASE_SIZE)
+		return writeBuffer[address % FLASH_ERASE_SIZE];
+	if (pendingBuffer && address >= pendingAddress)
+		return pendingBuffer[address % FLASH_ERASE_SIZE];
+	return SelfProgram::readByte(address);
+}
+
+// Add the LZ4 length extension bytes (if any) to `n`
+static bool readLz4Length(const uint8_t **data, const uint8_t *end, uint32_t *n) {
+	if (*n != 15)
+		return true;
+	uint8_t b;
+	do {
+		if (*data == end)
+			return false;
+		b = *(*data)++;
+		*n += b;
+	} while (b == 255);
+	return true;
+}
+
+/**
+ * @brief Walk the LZ4 sequences of a WRITE_FLASH_LZ4 frame.
+ *
+ * Without `write`, only checks that the sequences are complete and that
+ * all matches refer to data that was written before. With `write`, the
+ * output is appended to the page buffer and full pages are committed,
+ * matches are copied back from the page buffer or flash, so no window
+ * buffer is needed.
+ *
+ * @return decompressed size, or -1 if the sequences are invalid
+ */
+static int32_t decompressLz4(const uint8_t *data, uint8_t len, bool write, uint8_t *err) {
+	const uint8_t *end = data + len;
+	const uint32_t start = nextWriteAddress;
+	uint32_t produced = 0;
+
+	while (data < end) {
+		uint8_t token = *data++;
+
+		uint32_t n = token >> 4;
+		if (!readLz4Length(&data, end, &n) || n > (uint32_t)(end - data))
+			return -1;
+		produced += n;
+		while (write && n > 0) {
+			if ((*err = appendToPage(*data)))
+				return -1;
+			++data;
+			--n;
+		}
+		data += n;
+
+		// The last sequence has no match
+		if (data == end)
+			break;
+
+		if (end - data < 2)
+			return -1;
+		uint16_t distance = data[0] | data[1] << 8;
+		data += 2;
+		n = token & 0x0f;
+		if (!readLz4Length(&data, end, &n))
+			return -1;
+		n += 4;
+		if (distance == 0 || distance > start + produced)
+			return -1;
+		produced += n;
+		while (write && n > 0) {
+			if ((*err = appendToPage(readBack(distance))))
+				return -1;
+			--n;
+		}
+	}
+	return produced;
+}
+
+/**
+ * @brief WRITE_FLASH with LZ4 compressed data.
+ *
+ * The data is a sequence of LZ4 block format sequences, which may refer
+ * back up to 64KiB into data written by earlier frames. A frame must not
+ * decompress to more than one page (so it commits at most one page and
+ * the maximum response time holds), a frame without data just returns
+ * the page size.
+ *
+ * Request: address (4) of the decompressed data, LZ4 sequences (0+)
+ * Reply: next address (4), page size (2)
+ */
+static cmd_result handleWriteFlashLz4(uint32_t address, uint8_t *data, uint8_t len, uint8_t *dataout) {
+	if (len > 0) {
+		// Check it all before touching the page buffer, so a bad frame
+		// can just be sent again
+		uint8_t err = 0;
+		int32_t size = decompressLz4(data, len, false, &err);
+		if (size < 0 || (uint32_t)size > FLASH_ERASE_SIZE)
+			return cmd_result(Status::INVALID_ARGUMENTS);
+
+		cmd_result res = handleWriteFlash(address, nullptr, 0, dataout);
+		if (res.status != Status::COMMAND_OK)
+			return res;
+		if (nextWriteAddress + size > SelfProgram::applicationSize)
+			return cmd_result(Status::INVALID_ARGUMENTS);
+
+		if (decompressLz4(data, len, true, &err) < 0)
+			return writeFailed(err, dataout);
+	}
+
+	return writeProgress(dataout);
+}
+
+#ifndef STM32F4
+/**
+ * @brief Walk the operations of a WRITE_FLASH_DELTA frame.
+ *
+ * Works like decompressLz4(): without `write` it only validates, with
+ * `write` it appends the output to the page buffer.
+ *
+ * A copy reads the application as it was before this upload, so it may
+ * only use bytes that were not overwritten yet: those from the start
+ * of the page being assembled onwards (that page is still in flash,
+ * only the page buffer has changed). Once a copy crosses into the next
+ * page, the page it started in is committed, so from then on it may
+ * not read from behind its output anymore.
+ *
+ * @return size of the output, or -1 if the operations are invalid
+ */
+static int32_t applyDelta(const uint8_t *data, uint8_t len, bool write, uint8_t *err) {
+	static const uint8_t DELTA_COPY = 0x80;
+	const uint8_t *end = data + len;
+	const uint32_t start = nextWriteAddress;
+	uint32_t produced = 0;
+
+	while (data < end) {
+		uint8_t op = *data++;
+		if (!(op & DELTA_COPY)) {
+			uint8_t n = op + 1;
+			if (n > end - data)
+				return -1;
+			produced += n;
+			while (write && n > 0) {
+				if ((*err = appendToPage(*data)))
+					return -1;
+				++data;
+				--n;
 			}
+			data += n;
+			continue;
+		}
+
+		if (end - data < 6)
+			return -1;
+		uint32_t source = data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+		uint16_t n = data[4] << 8 | data[5];
+		data += 6;
+
+		uint32_t output = start + produced;
+		uint32_t pageStart = output - output % FLASH_ERASE_SIZE;
+		bool crossesPage = output % FLASH_ERASE_SIZE + n > FLASH_ERASE_SIZE;
+		if (source < pageStart || (crossesPage && source < output) || source + n > SelfProgram::applicationSize)
+			return -1;
+		produced += n;
+		while (write && n > 0) {
+			if ((*err = appendToPage(SelfProgram::readByte(source))))
+				return -1;
+			++source;
+			--n;
 		}
 	}
+	return produced;
+}
+#endif
 
-	return cmd_ok();
+/**
+ * @brief WRITE_FLASH built from the application already in flash.
+ *
+ * The data is a list of operations, each either inserting bytes from
+ * the frame or copying bytes from the old application (see applyDelta()
+ * for which bytes are still available):
+ *  - 0x00-0x7f: insert, followed by (op + 1) bytes of data
+ *  - 0x80: copy, followed by source address (4) and length (2)
+ *
+ * As with WRITE_FLASH_LZ4, a frame is validated before anything is
+ * written and must not produce more than one page.
+ *
+ * Request: address (4), operations (0+)
+ * Reply: next address (4), page size (2)
+ */
+static cmd_result handleWriteFlashDelta(uint32_t address, uint8_t *data, uint8_t len, uint8_t *dataout) {
+#ifdef STM32F4
+	// The first write to a sector erases all of it, including the later
+	// pages that would still be copied from
+	(void)address;
+	(void)data;
+	(void)len;
+	(void)dataout;
+	return cmd_result(Status::COMMAND_NOT_SUPPORTED);
+#else
+	if (len > 0) {
+		uint8_t err = takeCommitError();
+		if (err)
+			return writeFailed(err, dataout);
+		if (address == 0)
+			nextWriteAddress = 0;
+		if (address != nextWriteAddress)
+			return cmd_result(Status::INVALID_ARGUMENTS);
+		deltaUpload = true;
+
+		int32_t size = applyDelta(data, len, false, &err);
+		if (size < 0 || (uint32_t)size > FLASH_ERASE_SIZE || nextWriteAddress + size > SelfProgram::applicationSize)
+			return cmd_result(Status::INVALID_ARGUMENTS);
+
+		if (applyDelta(data, len, true, &err) < 0)
+			return writeFailed(err, dataout);
+	}
+
+	return writeProgress(dataout);
+#endif
 }
 
 /**
@@ -236,10 +814,63 @@ cmd_result readMemory(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dataou
 	return cmd_ok(readlen);
 }
 
+// Boot phase timing for application_startup_arguments.boot_profile. The
+// cycle counter wraps (after 25 s at 168 MHz), so the total is summed in
+// microseconds, at least once per pass of the idle main loop.
+static uint32_t cyclesPerUs = 1;
+static uint32_t phaseStart = 0;
+static uint32_t phaseCarryUs = 0;	///< Part of the phase before the clock changed
+static uint64_t totalUs = 0;
+
+// Microseconds since the last call, added to the total. The cycles short
+// of a microsecond count towards the next call.
+static uint32_t phaseUs() {
+	const uint32_t now = trace::cycles();
+	const uint32_t cycles = now - phaseStart;
+	phaseStart = now - cycles % cyclesPerUs;
+	const uint32_t us = phaseCarryUs + cycles / cyclesPerUs;
+	phaseCarryUs = 0;
+	totalUs += us;
+	return us;
+}
+
+#if defined(CLOCK_BOOST)
+// Run the flash and hash work at the boost clock. Only switch where the
+// bus is quiet: between a request and its reply, or with the bootloader
+// about to leave.
+static void boostClock(bool boost) {
+	const uint32_t now = trace::cycles();
+	const uint32_t hz = ClockBoost(boost);
+	if (!hz)
+		return;
+	// The cycles of the phase so far are of the previous clock
+	phaseCarryUs += (now - phaseStart) / cyclesPerUs;
+	phaseStart = now;
+	cyclesPerUs = hz / 1000000;
+	trace::log(trace::Event::boost, cyclesPerUs);
+	BusClockChanged();
+}
+#endif
+
 cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *dataout, uint8_t maxLen) {
 	if (maxLen < 5)
 		compiletime_check_failed();
 
+	// Only the writes may leave a page behind for the main loop, everything
+	// else sees the flash as uploaded so far
+	if (cmd != Commands::WRITE_FLASH && cmd != Commands::WRITE_FLASH_STREAM
+		&& cmd != Commands::WRITE_FLASH_LZ4 && cmd != Commands::WRITE_FLASH_DELTA)
+		commitPendingPage();
+
+#if defined(CLOCK_BOOST)
+	// The master waits for the reply to these, unlike for the frames of
+	// WRITE_FLASH_STREAM, so the bus divisor can change now
+	if (cmd == Commands::WRITE_FLASH || cmd == Commands::WRITE_FLASH_LZ4
+		|| cmd == Commands::WRITE_FLASH_DELTA || cmd == Commands::FINALIZE_FLASH
+		|| cmd == Commands::GET_PAGE_HASHES || cmd == Commands::COMPUTE_FINGERPRINT)
+		boostClock(true);
+#endif
+
 	switch (cmd) {
 		case Commands::GET_HARDWARE_INFO: {
 			if (len != 0)
@@ -276,11 +907,17 @@ cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *da
 		}
 
 		case Commands::START_APPLICATION:
-			if (len == 0) { // No fingerprint, need to check internal fingerprint
+			if (len == 0 || len == 1) { // No fingerprint, need to check internal fingerprint
+				// Unless a full check is asked for, the verified boot
+				// record can skip hashing an unchanged application
+				if (len == 1 && (datain[0] & ~START_FULL_CHECK))
+					return cmd_result(Status::INVALID_ARGUMENTS);
+				bootloaderFullCheck = len == 1 && (datain[0] & START_FULL_CHECK);
 				bootloaderFingerprintMatch = false;
 				bootloaderExit = true;
 			} else if (len == (sizeof(SelfProgram::appFwFingerprintSalt) + sizeof(SelfProgram::appFwFingerprint))) { // Check with fingerprint that was already calculated
-				if (((static_cast<uint32_t>(datain[0]) << 24 | datain[1] << 16 | datain[2] << 8 | datain[3]) == SelfProgram::appFwFingerprintSalt)
+				if (SelfProgram::appFwFingerprintValid
+					&& ((static_cast<uint32_t>(datain[0]) << 24 | datain[1] << 16 | datain[2] << 8 | datain[3]) == SelfProgram::appFwFingerprintSalt)
 					&& (memcmp(SelfProgram::appFwFingerprint, &datain[4], sizeof(SelfProgram::appFwFingerprint)) == 0)) {
 					bootloaderFingerprintMatch = true;
 				}
@@ -301,17 +938,50 @@ cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *da
 			uint32_t address = datain[0] << 24 | datain[1] << 16 | datain[2] << 8 | datain[3];
 			return handleWriteFlash(address, datain + 4, len - 4, dataout);
 		}
+		case Commands::WRITE_FLASH_STREAM:
+			if (maxLen < 8)
+				compiletime_check_failed();
+			return handleWriteFlashStream(datain, len, dataout);
+
+		case Commands::WRITE_FLASH_LZ4:
+		{
+			if (len < 4)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+			if (maxLen < 6)
+				compiletime_check_failed();
+
+			uint32_t address = datain[0] << 24 | datain[1] << 16 | datain[2] << 8 | datain[3];
+			return handleWriteFlashLz4(address, datain + 4, len - 4, dataout);
+		}
+		case Commands::WRITE_FLASH_DELTA:
+		{
+			if (len < 4)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+			if (maxLen < 6)
+				compiletime_check_failed();
+
+			uint32_t address = datain[0] << 24 | datain[1] << 16 | datain[2] << 8 | datain[3];
+			return handleWriteFlashDelta(address, datain + 4, len - 4, dataout);
+		}
 		case Commands::FINALIZE_FLASH:
 		{
 			if (len != 0)
 				return cmd_result(Status::INVALID_ARGUMENTS);
 
-			uint32_t pageAddress = nextWriteAddress & ~(sizeof(writeBuffer) - 1);
-			uint8_t err = commitToFlash(pageAddress, nextWriteAddress - pageAddress);
+			uint32_t pageAddress = nextWriteAddress & ~(FLASH_ERASE_SIZE - 1);
+			uint8_t err = takeCommitError();
+			if (!err)
+				err = commitToFlash(writeBuffer, pageAddress, nextWriteAddress - pageAddress);
+#ifdef STM32F4
+			if (!err)
+				err = SelfProgram::finishErasing();
+#endif
 			if (err) {
-				dataout[0] = err;
-				return cmd_result(Status::COMMAND_FAILED, 1);
+				return writeFailed(err, dataout);
 			} else {
+				// The image is complete, so the boot check only needs
+				// the flash after it
+				SelfProgram::unsaltedFingerprintFinish();
 				dataout[0] = SelfProgram::eraseCount;
 				SelfProgram::eraseCount = 0;
 				return cmd_ok(1);
@@ -321,6 +991,94 @@ cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *da
 		case Commands::READ_OTP:
 			return readMemory(cmd, datain, len, dataout, maxLen);
 
+		case Commands::GET_PAGE_HASHES: {
+			// Request: level (1), first node (2), count (1)
+			// Reply: page size (2), page count (2), count * hash
+			if (len != 4)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			uint8_t level = datain[0];
+			uint16_t index = datain[1] << 8 | datain[2];
+			uint8_t count = datain[3];
+			if (level > 15 || index + count > SelfProgram::pageTreeWidth(level)
+				|| 4 + count * SelfProgram::pageHashSize > maxLen)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			dataout[0] = FLASH_ERASE_SIZE >> 8;
+			dataout[1] = FLASH_ERASE_SIZE & 0xFF;
+			dataout[2] = SelfProgram::pageCount >> 8;
+			dataout[3] = SelfProgram::pageCount & 0xFF;
+			SelfProgram::getPageTreeHashes(level, index, count, dataout + 4);
+			return cmd_ok(4 + count * SelfProgram::pageHashSize);
+		}
+		case Commands::SET_BAUD: {
+			// Request: baud rate (4)
+			// The reply goes out at the current rate, then the bus
+			// switches. The master must follow with a valid frame within
+			// BUS_BAUD_FALLBACK_MS, or the previous rate is restored.
+			if (len != 4)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			uint32_t baud = (uint32_t)datain[0] << 24 | datain[1] << 16 | datain[2] << 8 | datain[3];
+			if (!BusSetBaudRate(baud))
+				return cmd_result(Status::INVALID_ARGUMENTS);
+			trace::log(trace::Event::baud, baud);
+			return cmd_ok();
+		}
+		case Commands::GET_WRITE_STATUS: {
+			// Reply: error (1), next address (4)
+			// Progress of broadcast WRITE_FLASH, with the page left
+			// for the main loop committed. The error is the first
+			// flash error since the write started at address 0, 0 if
+			// none. Does not change any state, so the master can ask
+			// again if the reply is lost.
+			if (len != 0)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			const size_t status_size = 5;
+			if (maxLen < status_size)
+				compiletime_check_failed();
+
+			// A page that failed verification in the main loop is
+			// where the next write will resume
+			const uint32_t next = verifyFailedPage != UINT32_MAX ? verifyFailedPage : nextWriteAddress;
+			dataout[0] = streamError ? streamError : commitError;
+			dataout[1] = next >> 24;
+			dataout[2] = next >> 16;
+			dataout[3] = next >> 8;
+			dataout[4] = next;
+			return cmd_ok(status_size);
+		}
+		case Commands::GET_STATS: {
+			// Reply: CRC errors (4), line errors (4), frames lost (4),
+			// bytes received (4), bytes committed (4), pages skipped (4),
+			// pages erased (4), erase cycles (8), program cycles (8),
+			// hash cycles (8)
+			// Counters since reset (see stats.hpp), so the master can
+			// tell a noisy link or a slow flash from a puppy that is
+			// fine. Cycles are of the CPU clock the bootloader runs at,
+			// the boost clock for the work done boosted (see
+			// ClockBoost()).
+			if (len != 0)
+				return cmd_result(Status::INVALID_ARGUMENTS);
+
+			const size_t stats_size = 7 * 4 + 3 * 8;
+			if (maxLen < stats_size)
+				compiletime_check_failed();
+
+			uint8_t *out = dataout;
+			out = putBigEndian(out, stats.crcErrors, 4);
+			out = putBigEndian(out, stats.lineErrors, 4);
+			out = putBigEndian(out, stats.framesLost, 4);
+			out = putBigEndian(out, stats.bytesReceived, 4);
+			out = putBigEndian(out, stats.bytesCommitted, 4);
+			out = putBigEndian(out, stats.pagesSkipped, 4);
+			out = putBigEndian(out, stats.pagesErased, 4);
+			out = putBigEndian(out, stats.eraseCycles, 8);
+			out = putBigEndian(out, stats.programCycles, 8);
+			putBigEndian(out, stats.hashCycles, 8);
+			return cmd_ok(stats_size);
+		}
 		case Commands::GET_FINGERPRINT: {
 			uint8_t offset = 0;
 			uint8_t size = sizeof(SelfProgram::appFwFingerprint);
@@ -334,6 +1092,16 @@ cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *da
 				return cmd_result(Status::INVALID_ARGUMENTS);
 			}
 
+			// Still hashing in the background, tell how far it got
+			if (SelfProgram::saltedFingerprintRunning()) {
+				uint32_t progress = SelfProgram::saltedFingerprintProgress();
+				dataout[0] = progress >> 24;
+				dataout[1] = progress >> 16;
+				dataout[2] = progress >> 8;
+				dataout[3] = progress;
+				return cmd_result(Status::BUSY, 4);
+			}
+
 			if (!SelfProgram::appFwFingerprintValid)
 				return cmd_result(Status::COMMAND_FAILED);
 
@@ -346,9 +1114,8 @@ cmd_result processCommand(uint8_t cmd, uint8_t *datain, uint8_t len, uint8_t *da
 				return cmd_result(Status::INVALID_ARGUMENTS);
 			}
 
-			SelfProgram::appFwFingerprintSalt = datain[0] << 24 | datain[1] << 16 | datain[2] << 8 | datain[3];
-
-			SelfProgram::calculateSaltedFingerprint(SelfProgram::appFwFingerprintSalt);
+			// Hashed by the main loop, GET_FINGERPRINT reports BUSY until done
+			SelfProgram::startSaltedFingerprint(datain[0] << 24 | datain[1] << 16 | datain[2] << 8 | datain[3]);
 			return cmd_ok();
 		}
 
@@ -364,36 +1131,77 @@ __attribute__((used)) const puppy_crash_dump::FWDescriptor * const fw_descriptor
 
 extern "C" {
 	void runBootloader() {
+		// .app_args is not initialized by the startup code
+		BootProfile &profile = application_startup_arguments.boot_profile;
+		profile = BootProfile();
+		application_startup_arguments.boot_profile_size = sizeof(BootProfile);
+#if defined(STM32C0)
+		// SysTick only counts once HAL_Init() set up the HAL tick
+		ClockInit();
+#else
+		// Counted at the reset clock, which ClockInit() switches from
+		const uint32_t resetCyclesPerUs = trace::startCycles();
+		const uint32_t clockStart = trace::cycles();
 		ClockInit();
+		profile.clock_init = (trace::cycles() - clockStart) / resetCyclesPerUs;
+#endif
+		cyclesPerUs = trace::init();
+		phaseStart = trace::cycles();
+		phaseCarryUs = 0;
+		totalUs = 0;
+
 		BusInit();
+		profile.bus_init = phaseUs();
 
 		rtt::init();
 		rtt::print("started\n");
 
 		// Configure watchdog
+		phaseUs();
 		WatchdogStart();
 		WatchdogReset();
+		profile.watchdog_start = phaseUs();
 
 		// Avoid doing anything as long as power panic is active
 		WaitForEndOfPowerPanic();
+		profile.power_panic = phaseUs();
 
 		led::set_rgb(0, 0, 0x0f); // blue: bl is running
+		profile.led = phaseUs();
 
 		StartFan();
         DisableHeaters();
 
+		phaseUs();
+		const uint64_t loopStart = totalUs;
+		bool firstFrame = false;
 		bool busy = true;
 		while (busy || !bootloaderExit) {
-			#if !defined(BUS_USE_INTERRUPTS)
 			busy = BusUpdate();
-			#endif // defined(BUS_USE_INTERRUPTS)
+			if (!busy) {
+				commitPendingPage();
+				preErasePage();
+				SelfProgram::saltedFingerprintStep();
+				phaseUs();
+			}
+			if (!firstFrame && stats.bytesReceived) {
+				firstFrame = true;
+				phaseUs();
+				profile.first_frame = totalUs - loopStart;
+			}
+			rtt::drainTrace();
 
 			WatchdogReset();
 		}
+		phaseUs();
 
                 //Check with unsalted fingerprint if necessary
 		if (bootloaderFingerprintMatch == false) {
-			bootloaderFingerprintMatch = SelfProgram::checkUnsaltedFingerprint(fw_descriptor->fingerprint); // Calculate and check match with fingerprint in descriptors
+#if defined(CLOCK_BOOST)
+			boostClock(true);
+#endif
+			bootloaderFingerprintMatch = SelfProgram::checkVerifiedFingerprint(fw_descriptor->fingerprint, bootloaderFullCheck); // Calculate and check match with fingerprint in descriptors, or the CRC next to them
+			profile.fingerprint_check = phaseUs();
 		}
 
 		if (fw_descriptor->stored_type == puppy_crash_dump::FWDescriptor::StoredType::crash_dump
@@ -408,9 +1216,17 @@ extern "C" {
 			}
 		}
 
+		phaseUs();
 		led::set_rgb(0, 0x0f, 0x0f); // cyan: fw is about to start
+		profile.led += phaseUs();
 		application_startup_arguments.modbus_address = getConfiguredAddress();
+#if defined(CLOCK_BOOST)
+		boostClock(false);
+#endif
 		BusDeinit();
+		profile.deinit = phaseUs();
+		profile.total = profile.clock_init + totalUs;
+		trace::deinit();
 		ClockDeinit();
 	}
 }
@@ -34,6 +34,15 @@ extern uint8_t info_hw_type;
 void runBootloader();
 void ClockInit();
 void ClockDeinit();
+#if defined(CLOCK_BOOST)
+/* Switch to (true) or back from (false) the fastest clock the MCU allows, for
+ * hashing and the flash paths. Returns the new core clock in Hz, 0 if it did
+ * not change, so the caller can re-derive what depends on it (see
+ * BusClockChanged()). Must be back at the ClockInit() clock before
+ * ClockDeinit().
+ */
+uint32_t ClockBoost(bool boost);
+#endif
 OTP_v5 GetOTPData();
 
 #ifdef __cplusplus
@@ -2,6 +2,7 @@ set(PREBOOT_SIZE     2048)
 set(BOOTLOADER_SIZE  6144)
 math(EXPR BL_SIZE "${PREBOOT_SIZE} + ${BOOTLOADER_SIZE}")
 set(FLASH_WRITE_SIZE 256)
+set(FLASH_PROGRAM_SIZE 8)
 set(FLASH_ERASE_SIZE 2048)
 set(FLASH_APP_OFFSET ${BL_SIZE})
 
@@ -13,10 +14,14 @@ target_sources(bootloader PRIVATE
     stm32-c0hal/system_stm32c0xx.c
     stm32-c0hal/startup_stm32c092xx.s
 
+    stm32-common/backup_registers.cpp
+    stm32-common/Crc16Hw.cpp
+    stm32-common/Crc32Hw.cpp
     stm32-common/iwdg.cpp
     stm32-common/power_panic.cpp
     stm32-common/Reset.cpp
     stm32-common/Rs485.cpp
+    stm32-common/TraceClock.cpp
 )
 
 set(HAL_SOURCES
@@ -50,11 +55,16 @@ target_compile_options(bootloader PRIVATE
 target_compile_definitions(bootloader PRIVATE
     STM32C092xx
     STM32C0
+    CRC16_IBM_BACKEND=CRC16_IBM_HW
+    SHA256_BACKEND=SHA256_SMALL
+    BUS_USE_INTERRUPTS
     USE_HAL_DRIVER
     USE_FULL_LL_DRIVER
     PREBOOT_SIZE=${PREBOOT_SIZE}
+    FLASH_VERIFY
     FLASH_ERASE_SIZE=${FLASH_ERASE_SIZE}
     FLASH_WRITE_SIZE=${FLASH_WRITE_SIZE}
+    FLASH_PROGRAM_SIZE=${FLASH_PROGRAM_SIZE}
     FLASH_APP_OFFSET=${FLASH_APP_OFFSET}
     "APPLICATION_SIZE=(256*1024-FLASH_APP_OFFSET)"
 )
@@ -1,5 +1,6 @@
 set(BL_SIZE          16384)
 set(FLASH_WRITE_SIZE 16384)
+set(FLASH_PROGRAM_SIZE 4)
 set(FLASH_ERASE_SIZE 16384)
 set(FLASH_APP_OFFSET ${BL_SIZE})
 
@@ -14,9 +15,12 @@ target_sources(bootloader PRIVATE
     stm32-f4hal/system_stm32f4xx.c
     stm32-f4hal/startup_stm32f427xx.s
 
+    stm32-common/backup_registers.cpp
+    stm32-common/Crc32Hw.cpp
     stm32-common/iwdg.cpp
     stm32-common/power_panic.cpp
     stm32-common/Reset.cpp
+    stm32-common/TraceClock.cpp
 )
 
 set(HAL_SOURCES
@@ -51,11 +55,14 @@ target_compile_options(bootloader PRIVATE
 target_compile_definitions(bootloader PRIVATE
     STM32F427xx
     STM32F4
+    CRC16_IBM_BACKEND=CRC16_IBM_TABLE
     USE_HAL_DRIVER
     USE_FULL_LL_DRIVER
     BL_SIZE=${BL_SIZE}
+    FLASH_VERIFY
     FLASH_ERASE_SIZE=${FLASH_ERASE_SIZE}
     FLASH_WRITE_SIZE=${FLASH_WRITE_SIZE}
+    FLASH_PROGRAM_SIZE=${FLASH_PROGRAM_SIZE}
     FLASH_APP_OFFSET=${FLASH_APP_OFFSET}
     "APPLICATION_SIZE=(2048*1024-FLASH_APP_OFFSET)"
 )
@@ -79,3 +86,12 @@ add_custom_command(TARGET bootloader POST_BUILD
     BYPRODUCTS ${OUT_BIN}
     VERBATIM
 )
+
+# The Thumb-2 kernel only runs on ARM hosts in sha256-bench, which CI does
+# not have, so it stays opt-in until it was checked against the C backends
+if(SHA256_ASM)
+    target_sources(bootloader PRIVATE sha256_thumb2.s)
+    target_compile_definitions(bootloader PRIVATE SHA256_BACKEND=SHA256_THUMB2)
+else()
+    target_compile_definitions(bootloader PRIVATE SHA256_BACKEND=SHA256_SMALL)
+endif()
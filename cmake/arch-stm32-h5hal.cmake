@@ -1,5 +1,6 @@
 set(BL_SIZE          8192)
 set(FLASH_WRITE_SIZE 8192)
+set(FLASH_PROGRAM_SIZE 16)
 set(FLASH_ERASE_SIZE 8192)
 set(FLASH_APP_OFFSET ${BL_SIZE})
 
@@ -11,10 +12,14 @@ target_sources(bootloader PRIVATE
     stm32-h5hal/system_stm32h5xx.c
     stm32-h5hal/startup_stm32h503cbux.s
 
+    stm32-common/backup_registers.cpp
+    stm32-common/Crc16Hw.cpp
+    stm32-common/Crc32Hw.cpp
     stm32-common/iwdg.cpp
     stm32-common/power_panic.cpp
     stm32-common/Reset.cpp
     stm32-common/Rs485.cpp
+    stm32-common/TraceClock.cpp
 )
 
 set(HAL_SOURCES
@@ -46,10 +51,15 @@ target_compile_options(bootloader PRIVATE
 target_compile_definitions(bootloader PRIVATE
     STM32H503xx
     STM32H5
+    CRC16_IBM_BACKEND=CRC16_IBM_HW
+    BUS_USE_INTERRUPTS
+    CLOCK_BOOST
     USE_HAL_DRIVER
     USE_FULL_LL_DRIVER
+    FLASH_VERIFY
     FLASH_ERASE_SIZE=${FLASH_ERASE_SIZE}
     FLASH_WRITE_SIZE=${FLASH_WRITE_SIZE}
+    FLASH_PROGRAM_SIZE=${FLASH_PROGRAM_SIZE}
     FLASH_APP_OFFSET=${FLASH_APP_OFFSET}
     "APPLICATION_SIZE=(128*1024-FLASH_APP_OFFSET)"
 )
@@ -74,3 +84,12 @@ add_custom_command(TARGET bootloader POST_BUILD
     BYPRODUCTS ${OUT_BIN}
     VERBATIM
 )
+
+# The Thumb-2 kernel only runs on ARM hosts in sha256-bench, which CI does
+# not have, so it stays opt-in until it was checked against the C backends
+if(SHA256_ASM)
+    target_sources(bootloader PRIVATE sha256_thumb2.s)
+    target_compile_definitions(bootloader PRIVATE SHA256_BACKEND=SHA256_THUMB2)
+else()
+    target_compile_definitions(bootloader PRIVATE SHA256_BACKEND=SHA256_SMALL)
+endif()
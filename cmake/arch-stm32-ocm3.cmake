@@ -1,10 +1,14 @@
 set(BL_SIZE          8192)
 set(FLASH_WRITE_SIZE 256)
+set(FLASH_PROGRAM_SIZE 256)
 set(FLASH_ERASE_SIZE 2048)
 set(FLASH_APP_OFFSET ${BL_SIZE})
 
 target_sources(bootloader PRIVATE
+    stm32-ocm3/backup_registers.cpp
     stm32-ocm3/Clock.cpp
+    stm32-ocm3/Crc16Hw.cpp
+    stm32-ocm3/Crc32Hw.cpp
     stm32-ocm3/iwdg.cpp
     stm32-ocm3/otp.cpp
     stm32-ocm3/power_panic.cpp
@@ -12,6 +16,7 @@ target_sources(bootloader PRIVATE
     stm32-ocm3/Rs485.cpp
     stm32-ocm3/security_features.cpp
     stm32-ocm3/SelfProgram.cpp
+    stm32-ocm3/TraceClock.cpp
 )
 
 target_include_directories(bootloader PRIVATE
@@ -28,8 +33,12 @@ target_compile_options(bootloader PRIVATE
 )
 target_compile_definitions(bootloader PRIVATE
     STM32G0
+    CRC16_IBM_BACKEND=CRC16_IBM_HW
+    SHA256_BACKEND=SHA256_SMALL
+    FLASH_VERIFY
     FLASH_ERASE_SIZE=${FLASH_ERASE_SIZE}
     FLASH_WRITE_SIZE=${FLASH_WRITE_SIZE}
+    FLASH_PROGRAM_SIZE=${FLASH_PROGRAM_SIZE}
     FLASH_APP_OFFSET=${FLASH_APP_OFFSET}
     "APPLICATION_SIZE=(128*1024-FLASH_APP_OFFSET)"
 )
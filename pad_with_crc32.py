@@ -6,6 +6,14 @@ import sys
 
 POLY = 0x04C11DB7
 
+# The descriptor region of crash_dump_shared.hpp, and the AppCrc record at
+# its end (see SelfProgram.h). The CRC covers the application up to the
+# region, which lies inside the application on the parts with more flash.
+DESCRIPTOR_OFFSET = 0x0001ff80 - 0x2000
+DESCRIPTOR_LENGTH = 128
+APP_CRC_OFFSET = DESCRIPTOR_OFFSET + DESCRIPTOR_LENGTH - 12
+APP_CRC_GUARD = 0x32435243
+
 # Matches STM32C0 CRC peripheral defaults.
 def crc32(data):
     crc = 0xFFFFFFFF
@@ -24,8 +32,12 @@ def self_test():
 
 def main(argv):
     self_test()
+    # With --descriptor, the CRC goes into the application's firmware
+    # descriptor for the bootloader's boot check, instead of at the end
+    descriptor = '--descriptor' in argv
+    argv = [arg for arg in argv if arg != '--descriptor']
     if len(argv) != 4:
-        print(f'usage: {argv[0]} <in.bin> <target-size> <out.bin>')
+        print(f'usage: {argv[0]} [--descriptor] <in.bin> <target-size> <out.bin>')
         return 1
 
     _, in_path, target_size, out_path = argv
@@ -38,10 +50,26 @@ def main(argv):
         print(f'refusing to overwrite input file: {in_path}')
         return 1
 
-    body_size = target_size - 4
+    body_size = DESCRIPTOR_OFFSET if descriptor else target_size - 4
+    if descriptor and target_size < DESCRIPTOR_OFFSET + DESCRIPTOR_LENGTH:
+        print(f'target size must hold the descriptor: {target_size}')
+        return 1
     with open(in_path, 'rb') as f:
         data = f.read()
 
+    if descriptor:
+        # The descriptor is part of the image, only the part before it is
+        # checked
+        if len(data) > target_size:
+            print(f'{in_path} too large: {len(data)} B (max {target_size})')
+            return 1
+        image = bytearray(data + b'\xff' * (target_size - len(data)))
+        crc = crc32(bytes(image[:body_size]))
+        image[APP_CRC_OFFSET:APP_CRC_OFFSET + 12] = struct.pack('<III', APP_CRC_GUARD, crc, crc ^ 0xFFFFFFFF)
+        with open(out_path, 'wb') as f:
+            f.write(image)
+        return 0
+
     if len(data) > body_size:
         print(f'{in_path} too large: {len(data)} B (max {body_size})')
         return 1
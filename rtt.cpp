@@ -1,52 +1,71 @@
 #include "rtt.hpp"
+#include "trace.hpp"
+
+#include <cstring>
 
 // #define RTT_ENABLED
 
-#ifdef RTT_ENABLED
+#if defined(RTT_ENABLED) || defined(TRACE_ENABLED)
+
+    #ifdef RTT_ENABLED
+        #warning "#undef RTT_ENABLED in release build"
+    #endif
 
-    #warning "#undef RTT_ENABLED in release build"
+struct RTTBuffer {
+    const char *name;
+    char *data;
+    unsigned size;
+    unsigned write_offset;
+    unsigned read_offset;
+    unsigned flags;
+};
 
 struct RTTControlBlock {
     char id[16];
     int up_buffer_count;
     int down_buffer_count;
-    // exactly one up buffer so just inline it here
-    const char *up_buffer_name;
-    char *up_buffer_data;
-    unsigned up_buffer_size;
-    unsigned up_buffer_write_offset;
-    unsigned up_buffer_read_offset;
-    unsigned up_buffer_flags;
+    // text (channel 0) and trace (channel 1) up buffers, inlined
+    RTTBuffer up_buffers[2];
     // no down buffer
 };
 
+    #ifdef RTT_ENABLED
 static char up_buffer[1024];
+    #else
+// No text in production builds, the channel only keeps the trace on
+// channel 1. A single byte buffer is always full.
+static char up_buffer[1];
+    #endif
 static volatile RTTControlBlock rtt_control_block;
+static volatile RTTBuffer &text_buffer = rtt_control_block.up_buffers[0];
 
-[[nodiscard]] static bool maybe_print_char(char c) {
-    unsigned write_offset = rtt_control_block.up_buffer_write_offset + 1;
-    if (write_offset == rtt_control_block.up_buffer_size) {
-        write_offset = 0;
-    }
-
-    if (write_offset != rtt_control_block.up_buffer_read_offset) {
-        *(rtt_control_block.up_buffer_data + rtt_control_block.up_buffer_write_offset) = c;
-        rtt_control_block.up_buffer_write_offset = write_offset;
-        return true;
-    } else {
-        return false;
-    }
-}
+    #if defined(TRACE_ENABLED)
+// A whole number of records, so one never wraps
+static char trace_buffer[64 * sizeof(trace::Record)];
+    #endif
 
 void rtt::init() {
+    #if defined(TRACE_ENABLED)
+    rtt_control_block.up_buffer_count = 2;
+    #else
     rtt_control_block.up_buffer_count = 1;
+    #endif
     rtt_control_block.down_buffer_count = 0;
-    rtt_control_block.up_buffer_name = "";
-    rtt_control_block.up_buffer_data = up_buffer;
-    rtt_control_block.up_buffer_size = sizeof(up_buffer);
-    rtt_control_block.up_buffer_write_offset = 0;
-    rtt_control_block.up_buffer_read_offset = 0;
-    rtt_control_block.up_buffer_flags = 0;
+    text_buffer.name = "";
+    text_buffer.data = up_buffer;
+    text_buffer.size = sizeof(up_buffer);
+    text_buffer.write_offset = 0;
+    text_buffer.read_offset = 0;
+    text_buffer.flags = 0;
+    #if defined(TRACE_ENABLED)
+    volatile RTTBuffer &trace_channel = rtt_control_block.up_buffers[1];
+    trace_channel.name = "trace";
+    trace_channel.data = trace_buffer;
+    trace_channel.size = sizeof(trace_buffer);
+    trace_channel.write_offset = 0;
+    trace_channel.read_offset = 0;
+    trace_channel.flags = 0;
+    #endif
     auto id = rtt_control_block.id;
     *id++ = 'S';
     *id++ = 'E';
@@ -60,6 +79,48 @@ void rtt::init() {
     *id++ = 'T';
 }
 
+void rtt::drainTrace() {
+    #if defined(TRACE_ENABLED)
+    volatile RTTBuffer &b = rtt_control_block.up_buffers[1];
+    trace::Record record;
+    // Never waits for the host: what does not fit stays in the trace
+    // ring, which drops new records once it is full
+    for (;;) {
+        const unsigned write_offset = b.write_offset;
+        const unsigned free = (b.read_offset + b.size - write_offset - 1) % b.size;
+        if (free < sizeof(record) || !trace::take(record))
+            break;
+        const unsigned next = write_offset + sizeof(record) == b.size ? 0 : write_offset + sizeof(record);
+        memcpy(b.data + write_offset, &record, sizeof(record));
+        b.write_offset = next;
+    }
+    #endif
+}
+
+#else
+
+void rtt::init() {}
+void rtt::drainTrace() {}
+
+#endif
+
+#ifdef RTT_ENABLED
+
+[[nodiscard]] static bool maybe_print_char(char c) {
+    unsigned write_offset = text_buffer.write_offset + 1;
+    if (write_offset == text_buffer.size) {
+        write_offset = 0;
+    }
+
+    if (write_offset != text_buffer.read_offset) {
+        *(text_buffer.data + text_buffer.write_offset) = c;
+        text_buffer.write_offset = write_offset;
+        return true;
+    } else {
+        return false;
+    }
+}
+
 void rtt::print(char c) {
     while (!maybe_print_char(c)) {
         // TODO this was giving me infinite loop, so let's break away and loose chars for now.
@@ -93,7 +154,7 @@ void rtt::print(uint32_t num) {
 
 void rtt::print(std::byte byte) {
     const auto v = (uint32_t)byte;
-    const char digits = "0123456789abcdef";
+    const char digits[] = "0123456789abcdef";
     const char hi = digits[(v >> 4) & 0xf];
     const char lo = digits[(v >> 0) & 0xf];
     rtt::print(hi);
@@ -104,7 +165,6 @@ void rtt::print(std::byte byte) {
 
 #else
 
-void rtt::init() {}
 void rtt::print(char) {}
 void rtt::print(const char *) {}
 void rtt::print(uint32_t) {}
@@ -17,10 +17,15 @@ void print(const char *);
 /// Print integer as decimal via RTT subsystem.
 void print(uint32_t);
 
+/// Copy the records of trace.hpp to the trace channel (1), as many as
+/// fit. Only does something with TRACE_ENABLED, which needs no
+/// RTT_ENABLED: the text channel stays off in production builds.
+void drainTrace();
+
 #if __cplusplus >= 201703L
 
 /// Print byte as hexadecimal via RTT subsystem.
-void rtt::print(std::byte);
+void print(std::byte);
 
 #endif
 
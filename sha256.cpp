@@ -30,7 +30,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#if SHA256_BACKEND == SHA256_SMALL
 #define MBEDTLS_SHA256_SMALLER
+#elif SHA256_BACKEND == SHA256_THUMB2
+#define MBEDTLS_SHA256_PROCESS_ALT
+#elif SHA256_BACKEND != SHA256_UNROLLED
+#error "Unknown SHA256_BACKEND"
+#endif
 
 /*
  * 32-bit integer manipulation macros (big endian)
@@ -86,8 +92,7 @@ void mbedtls_sha256_starts_ret( mbedtls_sha256_context *ctx )
     ctx->state[7] = 0x5BE0CD19;
 }
 
-#if !defined(MBEDTLS_SHA256_PROCESS_ALT)
-static const uint32_t K[] =
+const uint32_t sha256K[64] =
 {
     0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
     0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
@@ -107,6 +112,9 @@ static const uint32_t K[] =
     0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
 };
 
+#if !defined(MBEDTLS_SHA256_PROCESS_ALT)
+#define K sha256K
+
 #define  SHR(x,n) ((x & 0xFFFFFFFF) >> n)
 #define ROTR(x,n) (SHR(x,n) | (x << (32 - n)))
 
@@ -156,38 +164,51 @@ void mbedtls_internal_sha256_process( mbedtls_sha256_context *ctx,
         A[3] = A[2]; A[2] = A[1]; A[1] = A[0]; A[0] = temp1;
     }
 #else /* MBEDTLS_SHA256_SMALLER */
+    /*
+     * All 64 rounds inline. The variables rotate by renaming instead of
+     * moving, and every W and K index is a constant.
+     */
+#define P8(i, X)                                                    \
+    P( A[0], A[1], A[2], A[3], A[4], A[5], A[6], A[7], X(i+0), K[i+0] ); \
+    P( A[7], A[0], A[1], A[2], A[3], A[4], A[5], A[6], X(i+1), K[i+1] ); \
+    P( A[6], A[7], A[0], A[1], A[2], A[3], A[4], A[5], X(i+2), K[i+2] ); \
+    P( A[5], A[6], A[7], A[0], A[1], A[2], A[3], A[4], X(i+3), K[i+3] ); \
+    P( A[4], A[5], A[6], A[7], A[0], A[1], A[2], A[3], X(i+4), K[i+4] ); \
+    P( A[3], A[4], A[5], A[6], A[7], A[0], A[1], A[2], X(i+5), K[i+5] ); \
+    P( A[2], A[3], A[4], A[5], A[6], A[7], A[0], A[1], X(i+6), K[i+6] ); \
+    P( A[1], A[2], A[3], A[4], A[5], A[6], A[7], A[0], X(i+7), K[i+7] )
+#define LOADED(t) W[t]
+
     for( i = 0; i < 16; i++ )
         GET_UINT32_BE( W[i], data, 4 * i );
 
-    for( i = 0; i < 16; i += 8 )
-    {
-        P( A[0], A[1], A[2], A[3], A[4], A[5], A[6], A[7], W[i+0], K[i+0] );
-        P( A[7], A[0], A[1], A[2], A[3], A[4], A[5], A[6], W[i+1], K[i+1] );
-        P( A[6], A[7], A[0], A[1], A[2], A[3], A[4], A[5], W[i+2], K[i+2] );
-        P( A[5], A[6], A[7], A[0], A[1], A[2], A[3], A[4], W[i+3], K[i+3] );
-        P( A[4], A[5], A[6], A[7], A[0], A[1], A[2], A[3], W[i+4], K[i+4] );
-        P( A[3], A[4], A[5], A[6], A[7], A[0], A[1], A[2], W[i+5], K[i+5] );
-        P( A[2], A[3], A[4], A[5], A[6], A[7], A[0], A[1], W[i+6], K[i+6] );
-        P( A[1], A[2], A[3], A[4], A[5], A[6], A[7], A[0], W[i+7], K[i+7] );
-    }
-
-    for( i = 16; i < 64; i += 8 )
-    {
-        P( A[0], A[1], A[2], A[3], A[4], A[5], A[6], A[7], R(i+0), K[i+0] );
-        P( A[7], A[0], A[1], A[2], A[3], A[4], A[5], A[6], R(i+1), K[i+1] );
-        P( A[6], A[7], A[0], A[1], A[2], A[3], A[4], A[5], R(i+2), K[i+2] );
-        P( A[5], A[6], A[7], A[0], A[1], A[2], A[3], A[4], R(i+3), K[i+3] );
-        P( A[4], A[5], A[6], A[7], A[0], A[1], A[2], A[3], R(i+4), K[i+4] );
-        P( A[3], A[4], A[5], A[6], A[7], A[0], A[1], A[2], R(i+5), K[i+5] );
-        P( A[2], A[3], A[4], A[5], A[6], A[7], A[0], A[1], R(i+6), K[i+6] );
-        P( A[1], A[2], A[3], A[4], A[5], A[6], A[7], A[0], R(i+7), K[i+7] );
-    }
+    P8(  0, LOADED );
+    P8(  8, LOADED );
+    P8( 16, R );
+    P8( 24, R );
+    P8( 32, R );
+    P8( 40, R );
+    P8( 48, R );
+    P8( 56, R );
+
+#undef LOADED
+#undef P8
 #endif /* MBEDTLS_SHA256_SMALLER */
 
     for( i = 0; i < 8; i++ )
         ctx->state[i] += A[i];
 }
 
+#undef K
+
+#else /* !MBEDTLS_SHA256_PROCESS_ALT */
+
+void mbedtls_internal_sha256_process( mbedtls_sha256_context *ctx,
+                                const unsigned char data[64] )
+{
+    sha256ProcessThumb2( ctx->state, data, sha256K );
+}
+
 #endif /* !MBEDTLS_SHA256_PROCESS_ALT */
 
 /*
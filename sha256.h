@@ -37,6 +37,18 @@ extern "C" {
 // Regular implementation
 //
 
+/*
+ * Compression function, selected per board with -DSHA256_BACKEND=...
+ * All give the same result, they trade flash for speed.
+ */
+#define SHA256_SMALL    1   /*!< One round per loop iteration (MBEDTLS_SHA256_SMALLER) */
+#define SHA256_UNROLLED 2   /*!< All 64 rounds inline, no register rotation */
+#define SHA256_THUMB2   3   /*!< sha256_thumb2.s, Cortex-M3 and up (ARMv7-M, ARMv8-M Mainline) */
+
+#if !defined(SHA256_BACKEND)
+#define SHA256_BACKEND SHA256_SMALL
+#endif
+
 /**
  * \brief          The SHA-256 context structure.
  *
@@ -104,6 +116,21 @@ void mbedtls_sha256_finish_ret( mbedtls_sha256_context *ctx,
 void mbedtls_internal_sha256_process( mbedtls_sha256_context *ctx,
                                      const unsigned char data[64] );
 
+/**
+ * \brief          The SHA-256 round constants.
+ */
+extern const uint32_t sha256K[64];
+
+/**
+ * \brief          Compression function of the SHA256_THUMB2 backend.
+ *
+ * \param state    The intermediate digest state, updated in place.
+ * \param data     One block of data, no alignment required.
+ * \param K        The round constants (sha256K).
+ */
+void sha256ProcessThumb2( uint32_t state[8], const unsigned char data[64],
+                          const uint32_t K[64] );
+
 #ifdef __cplusplus
 }
 #endif
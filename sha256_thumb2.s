@@ -0,0 +1,124 @@
+/*
+ * SHA-256 compression function for Cortex-M3 and up (SHA256_THUMB2).
+ *
+ * void sha256ProcessThumb2(uint32_t state[8], const unsigned char data[64],
+ *                          const uint32_t K[64]);
+ *
+ * The working variables a..h stay in r4-r11 for all 64 rounds. Each
+ * round uses the barrel shifter for the rotations, so Sigma0/Sigma1 take
+ * three instructions each, and the variables rotate by renaming in an
+ * 8-round unrolled loop. The message schedule W[0..63] is expanded on
+ * the stack (256 bytes) before the rounds.
+ *
+ * `data` may be unaligned: single LDRs are fine unless CCR.UNALIGN_TRP is
+ * set, which none of the boards does.
+ *
+ * Checked against the C backends by sim/sha256_bench.cpp when that is
+ * built for an ARM host.
+ */
+
+    .syntax unified
+    .thumb
+
+/* h += Sigma1(e) + Ch(e,f,g) + K[i] + W[i]; d += h; h += Sigma0(a) + Maj(a,b,c)
+ * r0: &K[i], r1: &W[i], both advanced. Clobbers r2, r3. */
+    .macro ROUND a, b, c, d, e, f, g, h
+    ldr     r2, [r1], #4
+    ldr     r3, [r0], #4
+    add     \h, \h, r2
+    add     \h, \h, r3
+    ror     r2, \e, #6
+    eor     r2, r2, \e, ror #11
+    eor     r2, r2, \e, ror #25
+    add     \h, \h, r2
+    eor     r2, \f, \g
+    and     r2, r2, \e
+    eor     r2, r2, \g
+    add     \h, \h, r2
+    add     \d, \d, \h
+    ror     r2, \a, #2
+    eor     r2, r2, \a, ror #13
+    eor     r2, r2, \a, ror #22
+    add     \h, \h, r2
+    orr     r2, \a, \b
+    and     r2, r2, \c
+    and     r3, \a, \b
+    orr     r2, r2, r3
+    add     \h, \h, r2
+    .endm
+
+    .section .text.sha256ProcessThumb2, "ax", %progbits
+    .global sha256ProcessThumb2
+    .type   sha256ProcessThumb2, %function
+    .p2align 2
+sha256ProcessThumb2:
+    push    {r0-r2, r4-r11, lr}
+    sub     sp, sp, #256
+
+    /* W[0..15]: the block as big endian words */
+    mov     r3, sp
+    add     r12, sp, #64
+1:
+    ldr     r2, [r1], #4
+    rev     r2, r2
+    str     r2, [r3], #4
+    cmp     r3, r12
+    bne     1b
+
+    /* W[16..63] = sigma1(W[i-2]) + W[i-7] + sigma0(W[i-15]) + W[i-16] */
+    add     r1, sp, #64
+    add     r0, sp, #256
+2:
+    ldr     r2, [r1, #-8]
+    ror     r3, r2, #17
+    eor     r3, r3, r2, ror #19
+    eor     r3, r3, r2, lsr #10
+    ldr     r2, [r1, #-28]
+    add     r3, r3, r2
+    ldr     r2, [r1, #-60]
+    ror     r12, r2, #7
+    eor     r12, r12, r2, ror #18
+    eor     r12, r12, r2, lsr #3
+    add     r3, r3, r12
+    ldr     r2, [r1, #-64]
+    add     r3, r3, r2
+    str     r3, [r1], #4
+    cmp     r1, r0
+    bne     2b
+
+    /* 64 rounds, 8 per iteration */
+    ldr     r0, [sp, #256]
+    ldm     r0, {r4-r11}
+    ldr     r0, [sp, #264]
+    mov     r1, sp
+3:
+    ROUND   r4, r5, r6, r7, r8, r9, r10, r11
+    ROUND   r11, r4, r5, r6, r7, r8, r9, r10
+    ROUND   r10, r11, r4, r5, r6, r7, r8, r9
+    ROUND   r9, r10, r11, r4, r5, r6, r7, r8
+    ROUND   r8, r9, r10, r11, r4, r5, r6, r7
+    ROUND   r7, r8, r9, r10, r11, r4, r5, r6
+    ROUND   r6, r7, r8, r9, r10, r11, r4, r5
+    ROUND   r5, r6, r7, r8, r9, r10, r11, r4
+    add     r2, sp, #256
+    cmp     r1, r2
+    bne     3b
+
+    /* state += a..h */
+    ldr     r0, [sp, #256]
+    ldm     r0, {r1-r3, r12}
+    add     r4, r4, r1
+    add     r5, r5, r2
+    add     r6, r6, r3
+    add     r7, r7, r12
+    stmia   r0!, {r4-r7}
+    ldm     r0, {r1-r3, r12}
+    add     r8, r8, r1
+    add     r9, r9, r2
+    add     r10, r10, r3
+    add     r11, r11, r12
+    stm     r0, {r8-r11}
+
+    add     sp, sp, #256
+    pop     {r0-r2, r4-r11, pc}
+    .size   sha256ProcessThumb2, . - sha256ProcessThumb2
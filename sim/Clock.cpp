@@ -0,0 +1,16 @@
+#include "bootloader.h"
+#include "Sim.h"
+
+void ClockInit() {}
+
+void ClockDeinit() {}
+
+#if defined(CLOCK_BOOST)
+uint32_t ClockBoost(bool boost) {
+    const uint32_t hz = boost ? sim::family.boost_hz : sim::family.cpu_hz;
+    if (hz == sim::cpuHz())
+        return 0;
+    sim::setCpuHz(hz);
+    return hz;
+}
+#endif
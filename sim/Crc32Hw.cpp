@@ -0,0 +1,19 @@
+#include "Crc.h"
+#include "Sim.h"
+
+#include <cstring>
+
+// Bitwise model of the CRC peripheral's CRC-32, charged like the
+// hardware: a word per cycle, plus the load.
+uint32_t crc32Hw(const uint8_t *buf, uint32_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < len; i += 4) {
+        uint32_t word = 0xFFFFFFFF;
+        memcpy(&word, buf + i, len - i < 4 ? len - i : 4);
+        crc ^= word;
+        for (int bit = 0; bit < 32; ++bit)
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+    sim::spendCycles(sim::Cost::cpu, len / 2);
+    return crc;
+}
@@ -0,0 +1,95 @@
+#include "Delta.h"
+
+#include <algorithm>
+#include <cstring>
+
+static const uint8_t DELTA_COPY = 0x80;
+static const uint32_t max_insert = 128;
+
+sim::DeltaEncoder::DeltaEncoder(const std::vector<uint8_t> &image, const uint8_t *old, size_t old_size)
+    : image(image)
+    , old(old, old + old_size)
+    , head(1u << hash_bits, -1) {
+    // Later positions win, they are the ones most likely still unwritten
+    for (uint32_t i = 0; i + sizeof(uint32_t) <= old_size; ++i)
+        head[hash(old + i)] = i;
+}
+
+uint32_t sim::DeltaEncoder::hash(const uint8_t *p) const {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+// Length of a valid copy from the old `source` to `pos`
+uint32_t sim::DeltaEncoder::copyLength(uint32_t source, uint32_t pos, uint32_t limit, uint32_t page_size) const {
+    if (source < pos - pos % page_size)
+        return 0;
+    // Behind the output, the source is overwritten once the page is done
+    if (source < pos)
+        limit = std::min(limit, pos - pos % page_size + page_size);
+    uint32_t n = 0;
+    while (pos + n < limit && source + n < old.size() && n < 0xffff && old[source + n] == image[pos + n])
+        ++n;
+    return n;
+}
+
+static void putInserts(uint8_t *&out, const uint8_t *data, uint32_t len) {
+    while (len) {
+        uint32_t n = std::min(len, max_insert);
+        *out++ = n - 1;
+        memcpy(out, data, n);
+        out += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static size_t insertsSize(uint32_t len) {
+    return len + (len + max_insert - 1) / max_insert;
+}
+
+size_t sim::DeltaEncoder::encode(uint32_t offset, uint32_t page_size, uint8_t *out, size_t max_out, uint32_t *consumed) {
+    const uint32_t limit = std::min<uint32_t>(offset + page_size, image.size());
+    uint8_t *p = out;
+    uint32_t insert_start = offset;
+    uint32_t pos = offset;
+    while (pos < limit) {
+        uint32_t source = pos;
+        uint32_t n = copyLength(source, pos, limit, page_size);
+        if (n < min_copy && pos + sizeof(uint32_t) <= limit) {
+            const int32_t candidate = head[hash(&image[pos])];
+            if (candidate >= 0) {
+                source = candidate;
+                n = copyLength(source, pos, limit, page_size);
+            }
+        }
+        if (n < min_copy) {
+            ++pos;
+            continue;
+        }
+
+        const uint32_t inserts = pos - insert_start;
+        if (static_cast<size_t>(p - out) + insertsSize(inserts) + 7 > max_out)
+            break;
+        putInserts(p, &image[insert_start], inserts);
+        *p++ = DELTA_COPY;
+        *p++ = source >> 24;
+        *p++ = source >> 16;
+        *p++ = source >> 8;
+        *p++ = source;
+        *p++ = n >> 8;
+        *p++ = n;
+        pos += n;
+        insert_start = pos;
+    }
+
+    // Whatever is left is inserted, as far as it fits
+    uint32_t inserts = pos - insert_start;
+    while (inserts && static_cast<size_t>(p - out) + insertsSize(inserts) > max_out)
+        --inserts;
+    putInserts(p, &image[insert_start], inserts);
+
+    *consumed = insert_start + inserts - offset;
+    return p - out;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sim {
+
+/// Greedy encoder producing WRITE_FLASH_DELTA frames against the
+/// application that was in flash before the upload.
+///
+/// Copies only use source bytes the puppy has not overwritten yet (see
+/// applyDelta() in bootloader.cpp). Frames have to be encoded in image
+/// order.
+class DeltaEncoder {
+public:
+    DeltaEncoder(const std::vector<uint8_t> &image, const uint8_t *old, size_t old_size);
+
+    /// Same contract as Lz4Encoder::encode(); `page_size` is the puppy's
+    /// page size, which a frame must not produce more than.
+    size_t encode(uint32_t offset, uint32_t page_size, uint8_t *out, size_t max_out, uint32_t *consumed);
+
+private:
+    static const unsigned hash_bits = 16;
+    /// A copy takes 7 bytes, shorter ones are inserted
+    static const uint32_t min_copy = 8;
+
+    uint32_t hash(const uint8_t *p) const;
+    uint32_t copyLength(uint32_t source, uint32_t pos, uint32_t limit, uint32_t page_size) const;
+
+    const std::vector<uint8_t> &image;
+    std::vector<uint8_t> old;
+    std::vector<int32_t> head;
+};
+
+} // namespace sim
@@ -0,0 +1,100 @@
+#include "Sim.h"
+
+// Flash timings are typical values from the respective datasheets, CPU
+// costs are estimates for the -Os build. They are meant to make trends
+// visible, calibrate against a real board before trusting absolute
+// numbers.
+
+#if defined(STM32G0)
+
+// STM32G070: fast programming of a 256 byte row, 2 KiB pages
+const sim::Family sim::family = {
+    .name = "G0",
+    .cpu_hz = 64000000,
+    .boost_hz = 0,
+    .program_unit = 256,
+    .program_ns = 1700000,
+    .program_needs_erased = true,
+    .crc_cycles_per_byte = 8,
+    .sha256_cycles_per_byte = 140,
+    .decode_cycles_per_byte = 20,
+};
+
+uint32_t sim::eraseNs(uint32_t, uint32_t *size) {
+    *size = 2048;
+    return 22000000;
+}
+
+#elif defined(STM32C0)
+
+// STM32C092: double-word (64 bit) programming, 2 KiB pages
+const sim::Family sim::family = {
+    .name = "C0",
+    .cpu_hz = 48000000,
+    .boost_hz = 0,
+    .program_unit = 8,
+    .program_ns = 85000,
+    .program_needs_erased = true,
+    .crc_cycles_per_byte = 8,
+    .sha256_cycles_per_byte = 140,
+    .decode_cycles_per_byte = 20,
+};
+
+uint32_t sim::eraseNs(uint32_t, uint32_t *size) {
+    *size = 2048;
+    return 22000000;
+}
+
+#elif defined(STM32H5)
+
+// STM32H503: quad-word (128 bit) programming, 8 KiB sectors
+const sim::Family sim::family = {
+    .name = "H5",
+    .cpu_hz = 32000000,             // HSI/2, see stm32-h5hal/Clock.cpp
+    .boost_hz = 240000000,
+    .program_unit = 16,
+    .program_ns = 50000,
+    .program_needs_erased = true,
+    .crc_cycles_per_byte = 5,
+    .sha256_cycles_per_byte = 55,   // SHA256_SMALL (SHA256_THUMB2 with -DSHA256_ASM=ON: ~42)
+    .decode_cycles_per_byte = 20,
+};
+
+uint32_t sim::eraseNs(uint32_t, uint32_t *size) {
+    *size = 8192;
+    return 2000000;
+}
+
+#elif defined(STM32F4)
+
+// STM32F427: word (32 bit) programming at 2.7-3.6V, mixed sector sizes
+const sim::Family sim::family = {
+    .name = "F4",
+    .cpu_hz = 168000000,
+    .boost_hz = 0,
+    .program_unit = 4,
+    .program_ns = 16000,
+    .program_needs_erased = false,
+    .crc_cycles_per_byte = 8,
+    .sha256_cycles_per_byte = 60,   // SHA256_SMALL (SHA256_THUMB2 with -DSHA256_ASM=ON: ~42)
+    .decode_cycles_per_byte = 20,
+};
+
+uint32_t sim::eraseNs(uint32_t address, uint32_t *size) {
+    // Both banks have 4x16K, 1x64K and 7x128K sectors
+    uint32_t offset = address % (1024 * 1024);
+    if (offset < 64 * 1024) {
+        *size = 16 * 1024;
+        return 400000000;
+    } else if (offset < 128 * 1024) {
+        *size = 64 * 1024;
+        return 1100000000;
+    } else {
+        *size = 128 * 1024;
+        return 2000000000;
+    }
+}
+
+#else
+#error "Unknown simulated family"
+#endif
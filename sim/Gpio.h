@@ -0,0 +1,5 @@
+#pragma once
+
+// The simulator maps its flash array at the real flash address, so the
+// bootloader core can keep using plain pointers into flash.
+#define FLASH_BASE (0x08000000UL)
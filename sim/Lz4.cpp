@@ -0,0 +1,102 @@
+#include "Lz4.h"
+
+#include <cstring>
+
+sim::Lz4Encoder::Lz4Encoder(const std::vector<uint8_t> &image)
+    : image(image)
+    , head(1u << hash_bits, -1) {
+}
+
+uint32_t sim::Lz4Encoder::hash(uint32_t pos) const {
+    uint32_t v;
+    memcpy(&v, &image[pos], sizeof(v));
+    return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+// Make all positions before `pos` available as match candidates
+void sim::Lz4Encoder::insert(uint32_t pos) {
+    for (; inserted < pos; ++inserted)
+        if (inserted + min_match <= image.size())
+            head[hash(inserted)] = inserted;
+}
+
+// Length extension bytes needed for a 4 bit length field holding `n`
+static size_t extensionSize(uint32_t n) {
+    return n >= 15 ? (n - 15) / 255 + 1 : 0;
+}
+
+static size_t sequenceSize(uint32_t literals, uint32_t match) {
+    size_t size = 1 + extensionSize(literals) + literals;
+    if (match)
+        size += 2 + extensionSize(match - 4);
+    return size;
+}
+
+static void putLength(uint8_t *&out, uint32_t n) {
+    if (n < 15)
+        return;
+    for (n -= 15; n >= 255; n -= 255)
+        *out++ = 255;
+    *out++ = n;
+}
+
+static void putSequence(uint8_t *&out, const uint8_t *literals, uint32_t literal_len, uint32_t distance, uint32_t match) {
+    uint8_t token = (literal_len < 15 ? literal_len : 15) << 4;
+    if (match)
+        token |= match - 4 < 15 ? match - 4 : 15;
+    *out++ = token;
+    putLength(out, literal_len);
+    memcpy(out, literals, literal_len);
+    out += literal_len;
+    if (match) {
+        *out++ = distance;
+        *out++ = distance >> 8;
+        putLength(out, match - 4);
+    }
+}
+
+size_t sim::Lz4Encoder::encode(uint32_t offset, uint32_t max_produced, uint8_t *out, size_t max_out, uint32_t *consumed) {
+    const uint8_t *src = image.data();
+    uint32_t limit = offset + max_produced;
+    if (limit > image.size())
+        limit = image.size();
+
+    uint8_t *p = out;
+    uint32_t literal_start = offset;
+    uint32_t pos = offset;
+    while (pos + min_match <= limit) {
+        insert(pos);
+        const int32_t candidate = head[hash(pos)];
+        uint32_t match = 0;
+        // Earlier frames may have inserted positions from beyond their end
+        if (candidate >= 0 && static_cast<uint32_t>(candidate) < pos && pos - candidate <= window && !memcmp(src + candidate, src + pos, min_match)) {
+            match = min_match;
+            while (pos + match < limit && src[candidate + match] == src[pos + match])
+                ++match;
+        }
+        if (!match) {
+            ++pos;
+            continue;
+        }
+
+        const uint32_t literals = pos - literal_start;
+        if (static_cast<size_t>(p - out) + sequenceSize(literals, match) > max_out)
+            break;
+        putSequence(p, src + literal_start, literals, pos - candidate, match);
+        pos += match;
+        literal_start = pos;
+    }
+    if (pos + min_match > limit)
+        pos = limit;
+
+    // Whatever is left goes out as literals, as far as they fit
+    uint32_t literals = pos - literal_start;
+    while (literals && static_cast<size_t>(p - out) + sequenceSize(literals, 0) > max_out)
+        --literals;
+    if (literals)
+        putSequence(p, src + literal_start, literals, 0, 0);
+
+    *consumed = literal_start + literals - offset;
+    insert(offset + *consumed);
+    return p - out;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sim {
+
+/// Greedy LZ4 block format encoder producing WRITE_FLASH_LZ4 frames.
+///
+/// Matches may refer to anything before the current position (up to the
+/// 64 KiB LZ4 window), since the puppy copies them back from its page
+/// buffer or flash. Frames have to be encoded in image order.
+class Lz4Encoder {
+public:
+    explicit Lz4Encoder(const std::vector<uint8_t> &image);
+
+    /// Encode the data at `offset` into at most `max_out` bytes, producing
+    /// at most `max_produced` bytes of output on the puppy. Returns the
+    /// encoded size and sets `*consumed` to the number of image bytes.
+    size_t encode(uint32_t offset, uint32_t max_produced, uint8_t *out, size_t max_out, uint32_t *consumed);
+
+private:
+    static const unsigned hash_bits = 14;
+    static const uint32_t window = 65535;
+    static const uint32_t min_match = 4;
+
+    uint32_t hash(uint32_t pos) const;
+    void insert(uint32_t pos);
+
+    const std::vector<uint8_t> &image;
+    std::vector<int32_t> head;
+    uint32_t inserted = 0;
+};
+
+} // namespace sim
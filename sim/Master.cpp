@@ -0,0 +1,494 @@
+#include "Master.h"
+#include "Sim.h"
+
+#include "BaseProtocol.h"
+#include "Config.h"
+#include "Crc.h"
+#include "sha256.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+sim::Link sim::link;
+
+sim::Master::Master(const Options &options, const std::vector<uint8_t> &image)
+    : options(options)
+    , image(image)
+    , encoder(image)
+    , delta_encoder(image, sim::flash() + FLASH_APP_OFFSET, APPLICATION_SIZE) {
+}
+
+void sim::Master::fail(const char *what) const {
+    fprintf(stderr, "sim: master: %s (command 0x%02x, offset %u)\n", what, last_cmd, offset);
+    exit(1);
+}
+
+void sim::Master::frame(std::vector<uint8_t> &out, uint8_t cmd, const uint8_t *data, size_t len) {
+    frame(out, options.address, cmd, data, len);
+}
+
+void sim::Master::frame(std::vector<uint8_t> &out, uint8_t address, uint8_t cmd, const uint8_t *data, size_t len) {
+    out.clear();
+    out.push_back(address);
+    out.push_back(cmd);
+    out.insert(out.end(), data, data + len);
+    uint16_t crc = Crc16Ibm().update(out.data(), out.size()).get();
+    out.push_back(crc);
+    out.push_back(crc >> 8);
+    last_cmd = cmd;
+    request_start = sim::now();
+}
+
+void sim::Master::next(Phase phase) {
+    phase_end[static_cast<int>(current)] = sim::now();
+    current = phase;
+}
+
+// Host side of the page hash tree, over the image padded with blank flash
+void sim::Master::expectedNode(uint8_t level, uint16_t index, uint8_t *output) {
+    static const size_t hash_size = 8;
+    unsigned char hash[32];
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts_ret(&ctx);
+    if (level == 0) {
+        std::vector<uint8_t> page(std::min<uint32_t>(page_size, APPLICATION_SIZE - index * page_size), 0xff);
+        for (uint32_t i = 0; i < page.size() && index * page_size + i < image.size(); ++i)
+            page[i] = image[index * page_size + i];
+        mbedtls_sha256_update_ret(&ctx, page.data(), page.size());
+    } else {
+        if (2u * index + 1 >= treeWidth(level - 1)) {
+            expectedNode(level - 1, 2 * index, output);
+            return;
+        }
+        uint8_t children[2 * hash_size];
+        expectedNode(level - 1, 2 * index, children);
+        expectedNode(level - 1, 2 * index + 1, children + hash_size);
+        mbedtls_sha256_update_ret(&ctx, children, sizeof(children));
+    }
+    mbedtls_sha256_finish_ret(&ctx, hash);
+    memcpy(output, hash, hash_size);
+}
+
+void sim::Master::requestDiff(std::vector<uint8_t> &out) {
+    static const uint8_t max_count = (MAX_PACKET_LENGTH - 5 - 4) / 8;
+    // A run of consecutive nodes, the first request only asks for the
+    // tree geometry
+    tree_count = 0;
+    if (tree_pages) {
+        while (tree_count < tree_nodes.size() && tree_count < max_count
+               && tree_nodes[tree_count] == tree_nodes[0] + tree_count)
+            ++tree_count;
+    }
+    uint8_t data[4] = {
+        tree_level,
+        static_cast<uint8_t>(tree_pages ? tree_nodes[0] >> 8 : 0),
+        static_cast<uint8_t>(tree_pages ? tree_nodes[0] : 0),
+        tree_count,
+    };
+    frame(out, Cmd::GET_PAGE_HASHES, data, sizeof(data));
+}
+
+void sim::Master::replyDiff(const uint8_t *data, size_t len) {
+    if (len != 4u + tree_count * 8u)
+        fail("unexpected GET_PAGE_HASHES length");
+    if (!tree_pages) {
+        page_size = data[0] << 8 | data[1];
+        tree_pages = data[2] << 8 | data[3];
+        while (treeWidth(tree_level) > 1)
+            ++tree_level;
+        tree_nodes.push_back(0);
+        return;
+    }
+
+    for (uint8_t i = 0; i < tree_count; ++i) {
+        uint8_t expected[8];
+        const uint16_t node = tree_nodes[i];
+        expectedNode(tree_level, node, expected);
+        if (!memcmp(expected, data + 4 + 8 * i, sizeof(expected)))
+            continue;
+        if (tree_level == 0) {
+            // Pages behind the image keep whatever they held
+            if (static_cast<uint32_t>(node) * page_size < image.size())
+                changed.push_back(node);
+        } else {
+            tree_below.push_back(2 * node);
+            if (2u * node + 1 < treeWidth(tree_level - 1))
+                tree_below.push_back(2 * node + 1);
+        }
+    }
+    tree_nodes.erase(tree_nodes.begin(), tree_nodes.begin() + tree_count);
+
+    if (tree_nodes.empty() && tree_level > 0) {
+        tree_nodes.swap(tree_below);
+        --tree_level;
+    }
+    if (tree_nodes.empty()) {
+        next(Phase::write);
+        nextChangedPage();
+    }
+}
+
+// Go back to where the puppy continues after a page failed to verify
+void sim::Master::resendFrom(uint32_t address) {
+    ++resends;
+    offset = address;
+    stream_offset = address;
+    awaiting_ack = false;
+    query = false;
+    current = Phase::write;
+}
+
+// Continue the upload at the next changed page, or finish it
+void sim::Master::nextChangedPage() {
+    if (changed_next == changed.size()) {
+        next(Phase::finalize);
+        return;
+    }
+    offset = changed[changed_next++] * page_size;
+    page_end = std::min<uint32_t>(offset + page_size, image.size());
+}
+
+void sim::Master::requestWrite(std::vector<uint8_t> &out) {
+    uint8_t data[MAX_PACKET_LENGTH];
+    uint32_t n = (options.diff ? page_end : image.size()) - offset;
+    if (n > options.chunk)
+        n = options.chunk;
+    data[0] = offset >> 24;
+    data[1] = offset >> 16;
+    data[2] = offset >> 8;
+    data[3] = offset;
+    memcpy(data + 4, image.data() + offset, n);
+    sent = n;
+    frame(out, Cmd::WRITE_FLASH, data, 4 + n);
+}
+
+void sim::Master::requestStream(std::vector<uint8_t> &out) {
+    static const uint8_t STREAM_ACK = 0x01;
+    uint8_t data[MAX_PACKET_LENGTH];
+    uint32_t n = 0;
+    if (!query) {
+        n = image.size() - stream_offset;
+        if (n > options.chunk - 2u)
+            n = options.chunk - 2u;
+    }
+
+    // Ask for an acknowledgement when the puppy is about to commit a page
+    // (so flash is only busy while we wait, unless the puppy receives in
+    // the background), at the end of the image and when the window is full
+    const uint32_t end = stream_offset + n;
+    ++window_frames;
+    const bool ack = query
+        || (!options.overlap && stream_offset / window_bytes != end / window_bytes)
+        || end == image.size()
+        || window_frames >= options.window;
+
+    data[0] = ++seq;
+    data[1] = ack ? STREAM_ACK : 0;
+    data[2] = stream_offset >> 24;
+    data[3] = stream_offset >> 16;
+    data[4] = stream_offset >> 8;
+    data[5] = stream_offset;
+    memcpy(data + 6, image.data() + stream_offset, n);
+    frame(out, Cmd::WRITE_FLASH_STREAM, data, 6 + n);
+
+    stream_offset = end;
+    awaiting_ack = ack;
+    if (ack)
+        window_frames = 0;
+}
+
+void sim::Master::replyStream(const uint8_t *data) {
+    window_bytes = data[6] << 8 | data[7];
+    const uint32_t acked = (uint32_t)data[2] << 24 | data[3] << 16 | data[4] << 8 | data[5];
+    if (data[1] || acked != stream_offset) {
+        ++nacks;
+        pacing_ns += link.bytesNs(2);
+    }
+    offset = acked;
+    stream_offset = acked;
+    awaiting_ack = false;
+    query = false;
+    if (offset == image.size())
+        next(Phase::finalize);
+}
+
+void sim::Master::requestBroadcast(std::vector<uint8_t> &out) {
+    if (query) {
+        frame(out, Cmd::GET_WRITE_STATUS, nullptr, 0);
+        return;
+    }
+
+    uint8_t data[MAX_PACKET_LENGTH];
+    uint32_t n = image.size() - stream_offset;
+    if (n > options.chunk - 1u)
+        n = options.chunk - 1u;
+    data[0] = hw_type;
+    data[1] = stream_offset >> 24;
+    data[2] = stream_offset >> 16;
+    data[3] = stream_offset >> 8;
+    data[4] = stream_offset;
+    memcpy(data + 5, image.data() + stream_offset, n);
+    frame(out, BROADCAST_ADDRESS, Cmd::WRITE_FLASH, data, 5 + n);
+
+    // Check the progress when the puppies commit a page, which also
+    // leaves them the time to do so (STM32F4 may erase a sector first)
+    const uint32_t end = stream_offset + n;
+    query = stream_offset / FLASH_ERASE_SIZE != end / FLASH_ERASE_SIZE || end == image.size();
+    stream_offset = end;
+}
+
+void sim::Master::replyBroadcast(const uint8_t *data) {
+    if (data[0])
+        fail("flash error");
+    // A puppy that fell behind would get the rest with WRITE_FLASH to its
+    // own address. With a single puppy, broadcasting it again is the same.
+    const uint32_t acked = (uint32_t)data[1] << 24 | data[2] << 16 | data[3] << 8 | data[4];
+    if (acked != stream_offset)
+        ++nacks;
+    offset = acked;
+    stream_offset = acked;
+    query = false;
+    pacing_ns = 0;
+    if (offset == image.size())
+        next(Phase::finalize);
+}
+
+// WRITE_FLASH_LZ4 or WRITE_FLASH_DELTA
+void sim::Master::requestEncoded(std::vector<uint8_t> &out) {
+    uint8_t data[MAX_PACKET_LENGTH];
+    data[0] = offset >> 24;
+    data[1] = offset >> 16;
+    data[2] = offset >> 8;
+    data[3] = offset;
+    sent = 0;
+    size_t n = 0;
+    if (page_size && options.delta)
+        n = delta_encoder.encode(offset, page_size, data + 4, options.chunk, &sent);
+    else if (page_size)
+        n = encoder.encode(offset, page_size, data + 4, options.chunk, &sent);
+    frame(out, options.delta ? Cmd::WRITE_FLASH_DELTA : Cmd::WRITE_FLASH_LZ4, data, 4 + n);
+}
+
+void sim::Master::replyEncoded(const uint8_t *data) {
+    const uint32_t acked = (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+    page_size = data[4] << 8 | data[5];
+    offset += sent;
+    if (acked != offset)
+        fail("unexpected next address");
+    if (offset == image.size())
+        next(Phase::finalize);
+}
+
+// GET_STATS reply: seven 32 bit counters and three 64 bit cycle counts,
+// big endian
+void sim::Master::replyStats(const uint8_t *data, size_t len) {
+    if (len != 7 * 4 + 3 * 8)
+        fail("unexpected stats length");
+    uint64_t values[10];
+    for (int i = 0; i < 10; ++i) {
+        const size_t size = i < 7 ? 4 : 8;
+        values[i] = 0;
+        for (size_t j = 0; j < size; ++j)
+            values[i] = values[i] << 8 | *data++;
+    }
+    puppy_stats.crcErrors = values[0];
+    puppy_stats.lineErrors = values[1];
+    puppy_stats.framesLost = values[2];
+    puppy_stats.bytesReceived = values[3];
+    puppy_stats.bytesCommitted = values[4];
+    puppy_stats.pagesSkipped = values[5];
+    puppy_stats.pagesErased = values[6];
+    puppy_stats.eraseCycles = values[7];
+    puppy_stats.programCycles = values[8];
+    puppy_stats.hashCycles = values[9];
+}
+
+bool sim::Master::request(std::vector<uint8_t> &out) {
+    uint8_t data[MAX_PACKET_LENGTH];
+    switch (current) {
+    case Phase::version:
+        frame(out, Cmd::GET_PROTOCOL_VERSION, nullptr, 0);
+        return true;
+    case Phase::info:
+        frame(out, Cmd::GET_HARDWARE_INFO, nullptr, 0);
+        return true;
+    case Phase::baud:
+        data[0] = options.set_baud >> 24;
+        data[1] = options.set_baud >> 16;
+        data[2] = options.set_baud >> 8;
+        data[3] = options.set_baud;
+        frame(out, Cmd::SET_BAUD, data, 4);
+        return true;
+    case Phase::diff:
+        requestDiff(out);
+        return true;
+    case Phase::write:
+        if (options.lz4 || options.delta)
+            requestEncoded(out);
+        else if (options.broadcast)
+            requestBroadcast(out);
+        else if (options.window)
+            requestStream(out);
+        else
+            requestWrite(out);
+        return true;
+    case Phase::finalize:
+        frame(out, Cmd::FINALIZE_FLASH, nullptr, 0);
+        return true;
+    case Phase::compute:
+        data[0] = salt >> 24;
+        data[1] = salt >> 16;
+        data[2] = salt >> 8;
+        data[3] = salt;
+        frame(out, Cmd::COMPUTE_FINGERPRINT, data, 4);
+        return true;
+    case Phase::fingerprint:
+        frame(out, Cmd::GET_FINGERPRINT, nullptr, 0);
+        return true;
+    case Phase::stats:
+        frame(out, Cmd::GET_STATS, nullptr, 0);
+        return true;
+    case Phase::start:
+        if (options.boot_check) {
+            data[0] = 0x01; // START_FULL_CHECK
+            frame(out, Cmd::START_APPLICATION, data, options.full_check ? 1 : 0);
+        } else {
+            data[0] = salt >> 24;
+            data[1] = salt >> 16;
+            data[2] = salt >> 8;
+            data[3] = salt;
+            memcpy(data + 4, fingerprint, sizeof(fingerprint));
+            frame(out, Cmd::START_APPLICATION, data, 4 + sizeof(fingerprint));
+        }
+        return true;
+    case Phase::done:
+        break;
+    }
+    return false;
+}
+
+void sim::Master::reply(const uint8_t *frame, size_t len) {
+    if (!frame && current == Phase::write && options.window && !options.lz4 && !options.delta) {
+        // Only acknowledged frames get a reply, ask again for a lost one
+        if (awaiting_ack)
+            query = true;
+        return;
+    }
+    if (!frame && current == Phase::write && options.broadcast) {
+        // Broadcasts get no reply, a lost GET_WRITE_STATUS is asked again
+        // once the puppy had more time
+        if (last_cmd == Cmd::GET_WRITE_STATUS)
+            pacing_ns = pacing_ns ? pacing_ns * 2 : link.bytesNs(MAX_PACKET_LENGTH);
+        return;
+    }
+    if (!frame && current == Phase::fingerprint) {
+        pacing_ns = link.poll_ns;
+        return;
+    }
+    if (!frame)
+        fail("no reply");
+    if (len < 5 || frame[2] + 5u != len)
+        fail("malformed reply");
+    if (Crc16Ibm().update(const_cast<uint8_t *>(frame), len - 2).get() != (frame[len - 2] | frame[len - 1] << 8))
+        fail("reply CRC mismatch");
+    busy = current == Phase::fingerprint && frame[1] == Status::BUSY;
+    // A page read back wrong, the puppy went back to its start. Only the
+    // plain and windowed writes know how to send it again.
+    const bool resend = frame[1] == Status::COMMAND_FAILED && frame[2] == 5 && frame[3] == VERIFY_FAILED
+        && (current == Phase::write || current == Phase::finalize)
+        && !options.lz4 && !options.delta && !options.broadcast;
+    if (frame[1] != 0 && !busy && !resend)
+        fail("command failed");
+
+    Latency &l = latencies[last_cmd];
+    uint64_t ns = sim::now() - request_start;
+    ++l.count;
+    l.total_ns += ns;
+    if (ns > l.max_ns)
+        l.max_ns = ns;
+
+    const uint8_t *data = frame + 3;
+    if (resend) {
+        resendFrom((uint32_t)data[1] << 24 | data[2] << 16 | data[3] << 8 | data[4]);
+        return;
+    }
+    switch (current) {
+    case Phase::version:
+        next(Phase::info);
+        break;
+    case Phase::info: {
+        uint32_t size = (uint32_t)data[7] << 24 | data[8] << 16 | data[9] << 8 | data[10];
+        if (image.size() > size)
+            fail("image does not fit");
+        hw_type = data[0];
+        next(options.set_baud ? Phase::baud : options.diff ? Phase::diff : Phase::write);
+        break;
+    }
+    case Phase::baud:
+        // The puppy switches once the reply is out (see sim/Rs485.cpp)
+        next(options.diff ? Phase::diff : Phase::write);
+        break;
+    case Phase::diff:
+        replyDiff(data, frame[2]);
+        break;
+    case Phase::write:
+        if (options.lz4 || options.delta) {
+            replyEncoded(data);
+            break;
+        }
+        if (options.broadcast) {
+            replyBroadcast(data);
+            break;
+        }
+        if (options.window) {
+            replyStream(data);
+            break;
+        }
+        offset += sent;
+        if (options.diff && offset == page_end)
+            nextChangedPage();
+        else if (offset == image.size())
+            next(Phase::finalize);
+        break;
+    case Phase::finalize:
+        next(options.boot_check ? options.stats ? Phase::stats : Phase::start : Phase::compute);
+        break;
+    case Phase::compute:
+        next(Phase::fingerprint);
+        break;
+    case Phase::fingerprint: {
+        pacing_ns = 0;
+        if (busy)
+            break;
+        if (frame[2] != sizeof(fingerprint))
+            fail("unexpected fingerprint length");
+        memcpy(fingerprint, data, sizeof(fingerprint));
+
+        // What the puppy should have hashed: the salt followed by the
+        // whole application area
+        unsigned char expected[32];
+        mbedtls_sha256_context ctx;
+        mbedtls_sha256_init(&ctx);
+        mbedtls_sha256_starts_ret(&ctx);
+        mbedtls_sha256_update_ret(&ctx, reinterpret_cast<const unsigned char *>(&salt), sizeof(salt));
+        mbedtls_sha256_update_ret(&ctx, sim::flash() + FLASH_APP_OFFSET, APPLICATION_SIZE);
+        mbedtls_sha256_finish_ret(&ctx, expected);
+        if (memcmp(expected, fingerprint, sizeof(expected)) != 0)
+            fail("fingerprint mismatch");
+        next(options.stats ? Phase::stats : Phase::start);
+        break;
+    }
+    case Phase::stats:
+        replyStats(data, frame[2]);
+        next(Phase::start);
+        break;
+    case Phase::start:
+        next(Phase::done);
+        break;
+    case Phase::done:
+        break;
+    }
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "Delta.h"
+#include "Lz4.h"
+#include "stats.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sim {
+
+/// Parameters of the virtual RS485 link.
+struct Link {
+    uint32_t baud = 230400;
+    /// Idle time the puppy waits for before it considers a frame
+    /// complete, in bit times (IDLE flag: one character).
+    uint32_t puppy_gap_bits = 10;
+    /// Silence the master keeps between a reply and its next request,
+    /// in bit times (ModBus: 3.5 characters).
+    uint32_t master_gap_bits = 35;
+    /// Processing time of the master per reply.
+    uint32_t master_ns = 50000;
+    /// Time the master leaves a puppy that answered BUSY before it asks
+    /// again.
+    uint32_t poll_ns = 10000000;
+
+    uint64_t bytesNs(size_t bytes) const { return bitsNs(bytes * 10); }
+    uint64_t bitsNs(uint64_t bits) const { return bits * 1000000000ULL / baud; }
+};
+
+extern Link link;
+
+/// Command codes, as known to the master (see bootloader.cpp)
+struct Cmd {
+    static const uint8_t GET_PROTOCOL_VERSION = 0x00;
+    static const uint8_t GET_HARDWARE_INFO    = 0x03;
+    static const uint8_t START_APPLICATION    = 0x05;
+    static const uint8_t WRITE_FLASH          = 0x06;
+    static const uint8_t FINALIZE_FLASH       = 0x07;
+    static const uint8_t GET_FINGERPRINT      = 0x0e;
+    static const uint8_t COMPUTE_FINGERPRINT  = 0x0f;
+    static const uint8_t WRITE_FLASH_STREAM   = 0x11;
+    static const uint8_t WRITE_FLASH_LZ4      = 0x12;
+    static const uint8_t WRITE_FLASH_DELTA    = 0x13;
+    static const uint8_t GET_PAGE_HASHES      = 0x14;
+    static const uint8_t SET_BAUD             = 0x15;
+    static const uint8_t GET_WRITE_STATUS     = 0x16;
+    static const uint8_t GET_STATS            = 0x17;
+};
+
+/// Reason of a failed write for a page that read back wrong (see
+/// bootloader.cpp)
+static const uint8_t VERIFY_FAILED = 0x0f;
+
+/// Scripted master running the same sequence the printer uses to update a
+/// puppy: identify it, stream the image, finalize, have it fingerprinted
+/// and start it.
+class Master {
+public:
+    struct Options {
+        uint8_t address;
+        uint16_t chunk;
+        /// Start with START_APPLICATION without fingerprint, so the puppy
+        /// checks the unsalted fingerprint itself.
+        bool boot_check;
+        /// With boot_check, have the puppy hash the application even if
+        /// its verified boot record says it passed before
+        bool full_check;
+        /// Maximum frames per WRITE_FLASH_STREAM window, 0 to use plain
+        /// WRITE_FLASH
+        uint16_t window;
+        /// Keep streaming while the puppy commits a page instead of
+        /// waiting for an acknowledgement at each page boundary
+        bool overlap;
+        /// Upload with WRITE_FLASH_LZ4 (ignores window)
+        bool lz4;
+        /// Upload with WRITE_FLASH_DELTA against the application in
+        /// flash (ignores window and lz4)
+        bool delta;
+        /// Find the changed pages with GET_PAGE_HASHES first and only
+        /// upload those with WRITE_FLASH
+        bool diff;
+        /// Switch the link to this rate with SET_BAUD before writing,
+        /// 0 to keep the rate
+        uint32_t set_baud;
+        /// Send WRITE_FLASH to BROADCAST_ADDRESS and check the progress
+        /// with GET_WRITE_STATUS at each page boundary (ignores window)
+        bool broadcast;
+        /// Ask for the counters with GET_STATS before starting
+        bool stats;
+    };
+
+    /// Per command latency, from the first request byte to the last
+    /// reply byte.
+    struct Latency {
+        uint32_t count;
+        uint64_t total_ns;
+        uint64_t max_ns;
+    };
+
+    enum class Phase { version, info, baud, diff, write, finalize, compute, fingerprint, stats, start, done };
+
+    Master(const Options &options, const std::vector<uint8_t> &image);
+
+    /// Build the next request frame, returns false when the script is done
+    bool request(std::vector<uint8_t> &frame);
+    /// Process the reply to the last request (nullptr if none came)
+    void reply(const uint8_t *frame, size_t len);
+
+    Phase phase() const { return current; }
+    uint64_t phaseEnd(Phase phase) const { return phase_end[static_cast<int>(phase)]; }
+    const Latency &latency(uint8_t cmd) const { return latencies[cmd]; }
+    uint32_t nackCount() const { return nacks; }
+    uint32_t resendCount() const { return resends; }
+    /// What the puppy answered to GET_STATS
+    const Stats &puppyStats() const { return puppy_stats; }
+    /// Master processing time before the next request, if the last one
+    /// got no reply. Grows with every NACK in window mode, so the master
+    /// paces its frames to what the puppy can take. With broadcasts, only
+    /// a progress query waits, longer after each one that got lost.
+    uint64_t frameGapNs() const { return link.master_ns + (options.broadcast && !query ? 0 : pacing_ns); }
+    /// Master processing time before the next request, after a reply.
+    uint64_t replyGapNs() const { return link.master_ns + (busy ? link.poll_ns : 0); }
+
+private:
+    void fail(const char *what) const;
+    void frame(std::vector<uint8_t> &out, uint8_t cmd, const uint8_t *data, size_t len);
+    void frame(std::vector<uint8_t> &out, uint8_t address, uint8_t cmd, const uint8_t *data, size_t len);
+    void next(Phase phase);
+    void requestWrite(std::vector<uint8_t> &frame);
+    void requestStream(std::vector<uint8_t> &frame);
+    void replyStream(const uint8_t *data);
+    void requestBroadcast(std::vector<uint8_t> &frame);
+    void replyBroadcast(const uint8_t *data);
+    void requestDiff(std::vector<uint8_t> &frame);
+    void replyDiff(const uint8_t *data, size_t len);
+    void expectedNode(uint8_t level, uint16_t index, uint8_t *output);
+    uint32_t treeWidth(uint8_t level) const { return (tree_pages + (1u << level) - 1) >> level; }
+    void nextChangedPage();
+    void resendFrom(uint32_t address);
+    void requestEncoded(std::vector<uint8_t> &frame);
+    void replyEncoded(const uint8_t *data);
+    void replyStats(const uint8_t *data, size_t len);
+
+    Options options;
+    const std::vector<uint8_t> &image;
+    Phase current = Phase::version;
+    uint32_t offset = 0;
+    uint32_t sent = 0;
+    // WRITE_FLASH_STREAM state, offset is what the puppy acknowledged
+    uint32_t stream_offset = 0;
+    uint16_t window_bytes = 0;
+    uint16_t window_frames = 0;
+    uint8_t seq = 0;
+    bool awaiting_ack = false;
+    bool query = true;
+    // Broadcast WRITE_FLASH state, shares stream_offset and query
+    uint8_t hw_type = 0;
+    uint32_t nacks = 0;
+    uint32_t resends = 0;
+    uint64_t pacing_ns = 0;
+    // GET_FINGERPRINT got BUSY, so the next poll waits. A lost one (the
+    // polled driver misses frames while hashing) waits with pacing_ns.
+    bool busy = false;
+    // WRITE_FLASH_LZ4 and WRITE_FLASH_DELTA state, starts with a query
+    // for the page size
+    Lz4Encoder encoder;
+    DeltaEncoder delta_encoder;
+    uint16_t page_size = 0;
+    // GET_PAGE_HASHES state: the nodes of the current level that still
+    // need to be compared, and the pages found to differ
+    uint16_t tree_pages = 0;
+    uint8_t tree_level = 0;
+    uint8_t tree_count = 0;
+    std::vector<uint16_t> tree_nodes;
+    std::vector<uint16_t> tree_below;
+    std::vector<uint16_t> changed;
+    size_t changed_next = 0;
+    uint32_t page_end = 0;
+    uint32_t salt = 0x5a5a1234;
+    uint8_t fingerprint[32];
+    Stats puppy_stats = {};
+    uint8_t last_cmd = 0;
+    uint64_t request_start = 0;
+    uint64_t phase_end[static_cast<int>(Phase::done) + 1] = {};
+    Latency latencies[256] = {};
+};
+
+Master &master();
+
+} // namespace sim
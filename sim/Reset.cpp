@@ -0,0 +1,9 @@
+#include "BaseProtocol.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+void resetSystem() {
+    fprintf(stderr, "sim: system reset requested\n");
+    exit(1);
+}
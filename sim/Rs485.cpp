@@ -0,0 +1,173 @@
+#include "Bus.h"
+#include "BaseProtocol.h"
+#include "Config.h"
+#include "Master.h"
+#include "Sim.h"
+#include "stats.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+extern volatile bool bootloaderExit;
+
+void BusInit() {}
+
+void BusDeinit() {}
+
+static uint8_t busBuffer[MAX_PACKET_LENGTH];
+/// End of the processing of the last frame, or of the work the main loop
+/// did after it. If the USART is polled, bytes that arrive before that
+/// overrun the single byte receive register.
+static uint64_t puppyBusyUntil;
+/// Start of the master's next request. Between two calls the clock is the
+/// puppy's, so what runBootloader() does in between (committing a page)
+/// overlaps with the master's gap and the next request.
+static uint64_t masterNext;
+/// Puppy time when BusUpdate() last returned, if the main loop got
+/// further since, it has background work to do before the next request.
+static uint64_t lastReturn;
+
+/// Rate requested with SET_BAUD, applied once the reply is out, and the
+/// rate to fall back to if no valid frame arrives at the new one.
+static uint32_t nextBaud;
+static uint32_t fallbackBaud;
+static uint64_t fallbackStart;
+
+bool BusSetBaudRate(uint32_t baud) {
+    if (baud < BUS_MIN_BAUD_RATE || baud > sim::cpuHz() / 16)
+        return false;
+    nextBaud = baud;
+    return true;
+}
+
+void BusConfirmBaudRate() {
+    fallbackBaud = 0;
+}
+
+#if defined(CLOCK_BOOST)
+// The link is modelled in bit times, not divisors
+void BusClockChanged() {}
+#endif
+
+#if defined(BUS_USE_INTERRUPTS)
+/// Processing start of the frames waiting in the DMA ring. A frame is lost
+/// only if BUS_RX_FRAMES frames are still waiting when it ends.
+static std::deque<uint64_t> queued;
+
+static bool frameLost(uint64_t, uint64_t end) {
+    while (!queued.empty() && queued.front() <= end)
+        queued.pop_front();
+    if (queued.size() >= BUS_RX_FRAMES)
+        return true;
+    queued.push_back(puppyBusyUntil > end ? puppyBusyUntil : end);
+    return false;
+}
+#else
+static bool frameLost(uint64_t start, uint64_t) {
+    return puppyBusyUntil > start + sim::link.bytesNs(2);
+}
+#endif
+
+// Every call carries one complete request of the master over the virtual
+// link and, if the puppy answers, the reply back. Time on the wire and
+// on the puppy is charged to the simulated clock on the way.
+bool BusUpdate() {
+    static std::vector<uint8_t> request;
+    sim::Master &master = sim::master();
+    sim::drainTrace();
+
+    // Let the main loop go on with its work (one hash step at a time)
+    // until the master's next request is due
+    if (sim::now() != lastReturn && sim::now() < masterNext) {
+        lastReturn = sim::now();
+        return false;
+    }
+
+    if (sim::now() > puppyBusyUntil)
+        puppyBusyUntil = sim::now();
+    sim::resume(masterNext);
+
+    if (fallbackBaud && masterNext - fallbackStart >= BUS_BAUD_FALLBACK_MS * 1000000ULL) {
+        sim::link.baud = fallbackBaud;
+        fallbackBaud = 0;
+    }
+
+    if (!master.request(request)) {
+        if (!bootloaderExit) {
+            fprintf(stderr, "sim: master is done, but the bootloader did not exit\n");
+            exit(1);
+        }
+        return false;
+    }
+
+    ++sim::counters.frames;
+    sim::counters.bytes_tx += request.size();
+    const uint64_t request_start = sim::now();
+    sim::spend(sim::Cost::wire, sim::link.bytesNs(request.size()));
+    const uint64_t request_end = sim::now();
+    const bool lost = frameLost(request_start, request_end);
+
+    int len = 0;
+    if (lost) {
+        ++sim::counters.lost;
+        // The DMA ring was full, or the polled driver was busy and the
+        // USART overran
+#if defined(BUS_USE_INTERRUPTS)
+        ++stats.framesLost;
+#else
+        ++stats.lineErrors;
+#endif
+    } else if ((request[0] == getConfiguredAddress() || request[0] == BROADCAST_ADDRESS) && request.size() - 1 <= sizeof(busBuffer)) {
+        const uint8_t cmd = request[1];
+
+        // The DMA driver receives while the puppy is still busy, the frame
+        // waits in the ring until the previous ones are processed
+        if (puppyBusyUntil > sim::now())
+            sim::resume(puppyBusyUntil);
+        sim::spend(sim::Cost::turnaround, sim::link.bitsNs(sim::link.puppy_gap_bits));
+        memcpy(busBuffer, &request[1], request.size() - 1);
+        len = BusCallback(request[0], busBuffer, request.size() - 1, sizeof(busBuffer));
+        sim::spendCycles(sim::Cost::cpu, sim::family.crc_cycles_per_byte * (request.size() + len));
+
+        const bool ok = len > 1 && busBuffer[1] == 0;
+        if (ok && (cmd == sim::Cmd::WRITE_FLASH_LZ4 || cmd == sim::Cmd::WRITE_FLASH_DELTA) && request.size() > 8) {
+            // Decompressed size is the distance from the request's
+            // address to the next address in the reply
+            const uint32_t from = (uint32_t)request[2] << 24 | request[3] << 16 | request[4] << 8 | request[5];
+            const uint32_t to = (uint32_t)busBuffer[3] << 24 | busBuffer[4] << 16 | busBuffer[5] << 8 | busBuffer[6];
+            sim::spendCycles(sim::Cost::cpu, static_cast<uint64_t>(to - from) * sim::family.decode_cycles_per_byte);
+        }
+        puppyBusyUntil = sim::now();
+    }
+
+    uint64_t puppyFree;
+    if (len > 0) {
+        sim::counters.bytes_rx += len;
+        sim::spend(sim::Cost::wire, sim::link.bytesNs(len));
+        master.reply(busBuffer, len);
+        puppyFree = sim::now();
+        if (nextBaud) {
+            // Both ends switch right after the reply
+            fallbackBaud = sim::link.baud;
+            fallbackStart = puppyFree;
+            sim::link.baud = nextBaud;
+            nextBaud = 0;
+        }
+        sim::spend(sim::Cost::turnaround, sim::link.bitsNs(sim::link.master_gap_bits) + master.replyGapNs());
+    } else {
+        // Nothing to wait for (or the master times out on it): it goes on
+        // after its usual gap, while the puppy may still be busy
+        master.reply(nullptr, 0);
+        sim::resume(request_end);
+        sim::spend(sim::Cost::turnaround, sim::link.bitsNs(sim::link.master_gap_bits) + master.frameGapNs());
+        puppyFree = puppyBusyUntil > request_end ? puppyBusyUntil : request_end;
+    }
+    masterNext = sim::now();
+    sim::resume(puppyFree);
+    lastReturn = puppyFree;
+    // Busy if the next request is already on its way
+    return masterNext < puppyFree;
+}
@@ -0,0 +1,130 @@
+#include "SelfProgram.h"
+#include "Sim.h"
+#include "stats.hpp"
+#include "trace.hpp"
+
+#include <bitset>
+#include <cstring>
+
+static void eraseUnit(uint32_t address) {
+    uint32_t size;
+    uint32_t ns = sim::eraseNs(address + FLASH_APP_OFFSET, &size);
+    uint32_t start = (address + FLASH_APP_OFFSET) & ~(size - 1);
+    memset(sim::flash() + start, 0xff, size);
+    sim::spend(sim::Cost::erase, ns);
+    ++sim::counters.erases;
+}
+
+#if defined(STM32F4)
+// Sectors erased (or found blank) since startErasing(), by their start
+// address in units of the smallest sector
+static bool erasing = false;
+static std::bitset<2 * 1024 / 16> erasedSectors;
+
+// Erase a sector, unless it is blank already
+static void eraseSector(uint32_t start, uint32_t size) {
+    const uint8_t *flash = sim::flash() + FLASH_APP_OFFSET + start;
+    erasedSectors.set((start + FLASH_APP_OFFSET) / (16 * 1024));
+    // Blank check, a word per two cycles
+    sim::spendCycles(sim::Cost::cpu, size / 2);
+    for (uint32_t i = 0; i < size; ++i) {
+        if (flash[i] != 0xff) {
+            SelfProgram::nextWriteGeneration();
+            SelfProgram::pageHashesChanged(start, size);
+            trace::begin(trace::Event::erase, start / FLASH_ERASE_SIZE);
+            const uint32_t cycles = trace::cycles();
+            eraseUnit(start);
+            stats.eraseCycles += trace::cycles() - cycles;
+            trace::end(trace::Event::erase, start / FLASH_ERASE_SIZE);
+            ++stats.pagesErased;
+            if (SelfProgram::eraseCount < 0xff)
+                ++SelfProgram::eraseCount;
+            return;
+        }
+    }
+}
+
+void SelfProgram::startErasing() {
+    erasing = true;
+    erasedSectors.reset();
+}
+
+uint8_t SelfProgram::eraseSectors(uint32_t address, uint32_t len) {
+    const uint32_t end = address + len;
+    while (erasing && address < end) {
+        uint32_t start, size;
+        sim::eraseNs(address + FLASH_APP_OFFSET, &size);
+        start = ((address + FLASH_APP_OFFSET) & ~(size - 1)) - FLASH_APP_OFFSET;
+        if (!erasedSectors.test((start + FLASH_APP_OFFSET) / (16 * 1024)))
+            eraseSector(start, size);
+        address = start + size;
+    }
+    return 0;
+}
+
+uint8_t SelfProgram::finishErasing() {
+    uint8_t err = eraseSectors(0, applicationSize);
+    erasing = false;
+    return err;
+}
+#endif
+
+// Let the first cleared bit of a unit read back set, as if it failed to
+// program. A unit without any waits for the next one.
+static void programFlaky(uint8_t *unit, uint32_t size) {
+    for (uint32_t i = 0; i < size; ++i) {
+        const uint8_t zeros = ~unit[i];
+        if (zeros) {
+            unit[i] |= zeros & -zeros;
+            return;
+        }
+    }
+    ++sim::flaky_program;
+}
+
+uint8_t SelfProgram::erasePage(uint32_t address) {
+#if defined(STM32F4)
+    // Like the board: only whole sectors are erased, by eraseSectors()
+    (void)address;
+    return 1;
+#else
+    if (address % FLASH_ERASE_SIZE != 0 || address >= applicationSize)
+        return 1;
+
+    nextWriteGeneration();
+    eraseUnit(address);
+
+    // Invalidate fingerprint as the flash has just changed
+    SelfProgram::appFwFingerprintValid = false;
+    return 0;
+#endif
+}
+
+uint8_t SelfProgram::writePage(uint32_t address, uint8_t *data, uint16_t len) {
+    const uint32_t unit = sim::family.program_unit;
+    if (!len || len > FLASH_WRITE_SIZE || address % unit != 0 || address + len > applicationSize)
+        return 1;
+
+    nextWriteGeneration();
+
+    uint8_t *flash = sim::flash() + FLASH_APP_OFFSET;
+    for (uint32_t first = address - address % unit; first < address + len; first += unit) {
+        if (sim::family.program_needs_erased) {
+            for (uint32_t i = first; i < first + unit; ++i) {
+                if (flash[i] != 0xff)
+                    return 2;
+            }
+        }
+        for (uint32_t i = first; i < first + unit; ++i) {
+            uint8_t value = (i >= address && i < address + len) ? data[i - address] : 0xff;
+            flash[i] &= value;
+        }
+        sim::spend(sim::Cost::program, sim::family.program_ns);
+        if (++sim::counters.programs == sim::flaky_program)
+            programFlaky(flash + first, unit);
+    }
+
+    // Invalidate fingerprint as the flash has just changed
+    SelfProgram::appFwFingerprintValid = false;
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include "Sim.h"
+
+#include "Config.h"
+#include "sha256.h"
+#include "trace.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+sim::Counters sim::counters;
+uint32_t sim::flaky_program = 0;
+
+static uint64_t clock_ns;
+static uint32_t cpu_hz = sim::family.cpu_hz;
+/// Cycle count at cycles_ns, where the clock last changed
+static uint64_t cycles_base;
+static uint64_t cycles_ns;
+static uint64_t spent_ns[static_cast<int>(sim::Cost::count_)];
+static FILE *trace_file = nullptr;
+
+uint8_t *sim::flash() {
+    static uint8_t *mapping = nullptr;
+    if (!mapping) {
+        void *p = mmap(reinterpret_cast<void *>(FLASH_BASE), flashSize(), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (p != reinterpret_cast<void *>(FLASH_BASE)) {
+            perror("sim: cannot map flash at FLASH_BASE");
+            exit(1);
+        }
+        mapping = static_cast<uint8_t *>(p);
+        memset(mapping, 0xff, flashSize());
+    }
+    return mapping;
+}
+
+size_t sim::flashSize() {
+    return FLASH_APP_OFFSET + APPLICATION_SIZE;
+}
+
+bool sim::openTrace(const char *path) {
+    trace_file = fopen(path, "wb");
+    return trace_file != nullptr;
+}
+
+void sim::drainTrace() {
+    trace::Record record;
+    while (trace::take(record)) {
+        if (trace_file)
+            fwrite(&record, sizeof(record), 1, trace_file);
+    }
+    if (trace_file)
+        fflush(trace_file);
+}
+
+uint64_t sim::now() {
+    return clock_ns;
+}
+
+void sim::resume(uint64_t ns) {
+    clock_ns = ns;
+}
+
+uint32_t sim::cpuHz() {
+    return cpu_hz;
+}
+
+void sim::setCpuHz(uint32_t hz) {
+    cycles_base = cycles();
+    cycles_ns = clock_ns;
+    cpu_hz = hz;
+}
+
+uint64_t sim::cycles() {
+    // resume() may go back in time, to before the clock changed
+    const int64_t ns = static_cast<int64_t>(clock_ns - cycles_ns);
+    const int64_t per_us = cpu_hz / 1000000;
+    return cycles_base + ns / 1000 * per_us + ns % 1000 * per_us / 1000;
+}
+
+void sim::restart() {
+    clock_ns = 0;
+    cpu_hz = family.cpu_hz;
+    cycles_base = 0;
+    cycles_ns = 0;
+    memset(spent_ns, 0, sizeof(spent_ns));
+    counters = Counters();
+}
+
+void sim::spend(Cost cost, uint64_t ns) {
+    clock_ns += ns;
+    spent_ns[static_cast<int>(cost)] += ns;
+}
+
+void sim::spendCycles(Cost cost, uint64_t cycles) {
+    spend(cost, cycles * 1000000000ULL / cpu_hz);
+}
+
+uint64_t sim::spent(Cost cost) {
+    return spent_ns[static_cast<int>(cost)];
+}
+
+void sim::chargeHash(uint32_t len) {
+    counters.hashed += len;
+    spendCycles(Cost::hash, static_cast<uint64_t>(len) * family.sha256_cycles_per_byte);
+}
+
+// SelfProgramCommon.cpp calls this instead of mbedtls_sha256_update_ret
+// (see CMakeLists.txt)
+extern "C" void sim_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen) {
+    sim::chargeHash(ilen);
+    mbedtls_sha256_update_ret(ctx, input, ilen);
+}
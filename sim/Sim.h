@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// Host-side model of a puppy, shared by the simulated hardware backends.
+///
+/// Nothing in here runs on a real board. Time is virtual: every modelled
+/// action (a byte on the wire, a page erase, a hash pass) advances a
+/// global nanosecond counter by a fixed amount, so results are exactly
+/// reproducible between runs and machines.
+namespace sim {
+
+/// Where simulated time was spent.
+enum class Cost {
+    wire,       ///< Request and reply bytes on the RS485 link
+    turnaround, ///< Bus direction switch on both ends
+    cpu,        ///< Frame processing on the puppy (CRC, copying, compares)
+    erase,      ///< Flash erase
+    program,    ///< Flash programming
+    hash,       ///< SHA-256 over application flash
+    count_
+};
+
+/// Timing and geometry of one MCU family.
+struct Family {
+    const char *name;
+    uint32_t cpu_hz;
+    /// Clock of ClockBoost() (see CLOCK_BOOST), 0 for none. Flash timings
+    /// stay the same, CPU costs scale.
+    uint32_t boost_hz;
+    /// Native program unit in bytes and its typical duration.
+    uint32_t program_unit;
+    uint32_t program_ns;
+    /// True if programming a non-erased unit fails (ECC flash), false if
+    /// it silently ANDs into the existing content.
+    bool program_needs_erased;
+    /// Cycles spent per byte by the board's Crc16Ibm backend (see
+    /// CRC16_IBM_BACKEND) in BusCallback.
+    uint32_t crc_cycles_per_byte;
+    /// Cycles spent per byte by the board's SHA-256 backend (see
+    /// SHA256_BACKEND).
+    uint32_t sha256_cycles_per_byte;
+    /// Cycles spent per output byte of WRITE_FLASH_LZ4 and
+    /// WRITE_FLASH_DELTA, both passes.
+    uint32_t decode_cycles_per_byte;
+};
+
+extern const Family family;
+
+/// Typical erase duration of the erase unit that contains `address`
+/// (relative to the start of flash), together with its size.
+uint32_t eraseNs(uint32_t address, uint32_t *size);
+
+/// Simulated flash, mapped at its real address (FLASH_BASE).
+uint8_t *flash();
+size_t flashSize();
+
+uint64_t now();
+/// Current CPU clock, family.cpu_hz unless boosted
+uint32_t cpuHz();
+/// Switch the CPU clock, the cycle counter goes on from where it is
+void setCpuHz(uint32_t hz);
+/// CPU cycles since restart(), at the clocks set with setCpuHz()
+uint64_t cycles();
+/// Continue at `ns`, which may be earlier than now() when the master goes
+/// on while the puppy is still busy. Time spent is accounted per cost in
+/// either case, so the costs can add up to more than the total.
+void resume(uint64_t ns);
+/// Start over at time 0 with all costs and counters cleared, keeping the
+/// flash content.
+void restart();
+void spend(Cost cost, uint64_t ns);
+void spendCycles(Cost cost, uint64_t cycles);
+uint64_t spent(Cost cost);
+
+struct Counters {
+    uint32_t frames;
+    uint32_t lost;      ///< Frames that arrived while the puppy was busy
+    uint32_t bytes_tx;  ///< Master to puppy, including address and CRC
+    uint32_t bytes_rx;  ///< Puppy to master, including address and CRC
+    uint32_t erases;
+    uint32_t programs;  ///< Native program units written
+    uint32_t hashed;    ///< Bytes run through SHA-256
+};
+
+extern Counters counters;
+
+/// Program unit (counting from 1, like counters.programs) that leaves a
+/// bit set, to exercise FLASH_VERIFY. 0 for none.
+extern uint32_t flaky_program;
+
+/// Write the records of trace.hpp to `path`, in the format of the RTT
+/// trace channel (see trace_decode.py). drainTrace() takes the ones
+/// recorded since the last call, like rtt::drainTrace() (see
+/// sim/rtt.cpp) does for the main loop.
+bool openTrace(const char *path);
+void drainTrace();
+
+/// Charge the modelled time of hashing `len` bytes of flash.
+void chargeHash(uint32_t len);
+
+} // namespace sim
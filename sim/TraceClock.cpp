@@ -0,0 +1,14 @@
+#include "trace.hpp"
+#include "Sim.h"
+
+// The modelled time, in cycles of the family's clock
+uint32_t trace::startCycles() {
+    return sim::cpuHz() / 1000000;
+}
+
+void trace::stopCycles() {
+}
+
+uint32_t trace::cycles() {
+    return sim::cycles();
+}
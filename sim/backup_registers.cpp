@@ -0,0 +1,12 @@
+#include "backup_registers.hpp"
+
+// Cleared like after a power cycle, main.cpp fills them for --warm
+static uint32_t registers[BACKUP_REGISTER_COUNT];
+
+uint32_t read_backup_register(uint8_t index) {
+    return registers[index];
+}
+
+void write_backup_register(uint8_t index, uint32_t value) {
+    registers[index] = value;
+}
@@ -0,0 +1,5 @@
+#include "iwdg.hpp"
+
+void WatchdogStart() {}
+
+void WatchdogReset() {}
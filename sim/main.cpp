@@ -0,0 +1,374 @@
+#include "Master.h"
+#include "Sim.h"
+
+#include "bootloader.h"
+#include "BaseProtocol.h"
+#include "Bus.h"
+#include "SelfProgram.h"
+#include "Crc.h"
+#include "crash_dump_shared.hpp"
+#include "app_args_shared.hpp"
+#include "sha256.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static sim::Master *current_master;
+
+// Left for the application by runBootloader() (see bootloader.cpp)
+extern ApplicationStartupArguments application_startup_arguments;
+
+sim::Master &sim::master() {
+    return *current_master;
+}
+
+void startApplication() {
+    // Nothing to jump to, the simulation ends here
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --image FILE   upload FILE instead of a generated image\n"
+        "  --used N       bytes of non-blank data in the generated image (default: half)\n"
+        "  --preload      flash already holds the image (unchanged firmware)\n"
+        "  --chunk N      WRITE_FLASH payload bytes (default: largest that fits)\n"
+        "  --window N     use WRITE_FLASH_STREAM with up to N frames per acknowledgement\n"
+        "  --overlap      with --window, keep streaming while the puppy commits a page\n"
+        "  --broadcast    send WRITE_FLASH to the broadcast address, GET_WRITE_STATUS per page\n"
+        "  --lz4          use WRITE_FLASH_LZ4 (compressed)\n"
+        "  --delta        use WRITE_FLASH_DELTA against the application in flash\n"
+        "  --diff         upload only the pages GET_PAGE_HASHES reports as changed\n"
+        "  --patch N      preload, then upload the image with N bytes changed and\n"
+        "                 64 bytes removed in the middle of the used data\n"
+        "  --baud N       link speed (default: %u)\n"
+        "  --set-baud N   switch the link to N with SET_BAUD before writing\n"
+        "  --boot-check   start without fingerprint, puppy checks the descriptor\n"
+        "  --crc32        generated image's descriptor carries a CRC-32 for the boot check\n"
+        "  --full-check   with --boot-check, ignore the verified boot record\n"
+        "  --warm         preload, with a verified boot record from a previous boot\n"
+        "  --flaky N      the Nth program unit leaves a bit set, which the puppy\n"
+        "                 should find and have the master send again\n"
+        "  --trace FILE   write the trace records (see trace_decode.py) to FILE\n"
+        "  --stats        ask for the puppy's counters with GET_STATS before starting\n"
+        "  --boot-budget N  fail if the boot profile's total exceeds N us\n"
+        "  --csv          print a single CSV line (with --csv-header: header only)\n",
+        argv0, sim::link.baud);
+    exit(2);
+}
+
+// Deterministic firmware-like content: runs of code-ish bytes mixed
+// with zero-filled tables, followed by blank (0xff) padding
+static std::vector<uint8_t> generateImage(uint32_t used, bool crc32) {
+    std::vector<uint8_t> image(SelfProgram::applicationSize, 0xff);
+    uint32_t state = 0x12345678;
+    for (uint32_t i = 0; i < used; ++i) {
+        state = state * 1103515245 + 12345;
+        uint8_t b = state >> 16;
+        image[i] = (i / 512) % 4 == 3 ? (b & 0x07) : b;
+    }
+
+    // Valid descriptor, so the boot-time check can pass
+    if (puppy_crash_dump::APP_DESCRIPTOR_OFFSET + sizeof(puppy_crash_dump::FWDescriptor) <= image.size()) {
+        puppy_crash_dump::FWDescriptor descriptor;
+        memset(static_cast<void *>(&descriptor), 0, sizeof(descriptor));
+        descriptor.stored_type = puppy_crash_dump::FWDescriptor::StoredType::fw;
+
+        mbedtls_sha256_context ctx;
+        mbedtls_sha256_init(&ctx);
+        mbedtls_sha256_starts_ret(&ctx);
+        mbedtls_sha256_update_ret(&ctx, image.data(), SelfProgram::applicationSize - FW_DESCRIPTOR_SIZE);
+        mbedtls_sha256_finish_ret(&ctx, descriptor.fingerprint);
+        memcpy(&image[puppy_crash_dump::APP_DESCRIPTOR_OFFSET], &descriptor, sizeof(descriptor));
+        if (crc32) {
+            AppCrc record;
+            record.guard = APP_CRC_GUARD;
+            record.crc32 = crc32Hw(image.data(), APP_CRC_SIZE);
+            record.crc32Inverted = ~record.crc32;
+            memcpy(&image[APP_CRC_OFFSET], &record, sizeof(record));
+        }
+    }
+    return image;
+}
+
+static std::vector<uint8_t> loadImage(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    std::vector<uint8_t> image;
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        image.insert(image.end(), buf, buf + n);
+    fclose(f);
+    if (image.size() > SelfProgram::applicationSize) {
+        fprintf(stderr, "%s: image larger than the application area\n", path);
+        exit(1);
+    }
+    return image;
+}
+
+static double ms(uint64_t ns) {
+    return ns / 1e6;
+}
+
+int main(int argc, char **argv) {
+    const char *path = nullptr;
+    uint32_t used = SelfProgram::applicationSize / 2;
+    bool preload = false;
+    bool warm = false;
+    bool crc32 = false;
+    uint32_t patch = 0;
+    bool csv = false;
+    uint32_t boot_budget = 0;
+    sim::Master::Options options = {
+        .address = INITIAL_ADDRESS,
+        .chunk = MAX_PACKET_LENGTH - 8, // address, cmd, 4 byte offset, crc
+        .boot_check = false,
+        .full_check = false,
+        .window = 0,
+        .overlap = false,
+        .lz4 = false,
+        .delta = false,
+        .diff = false,
+        .set_baud = 0,
+        .broadcast = false,
+        .stats = false,
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (!strcmp(arg, "--image") && value) {
+            path = value;
+            ++i;
+        } else if (!strcmp(arg, "--used") && value) {
+            used = strtoul(value, nullptr, 0);
+            ++i;
+        } else if (!strcmp(arg, "--chunk") && value) {
+            options.chunk = strtoul(value, nullptr, 0);
+            ++i;
+        } else if (!strcmp(arg, "--window") && value) {
+            options.window = strtoul(value, nullptr, 0);
+            ++i;
+        } else if (!strcmp(arg, "--baud") && value) {
+            sim::link.baud = strtoul(value, nullptr, 0);
+            ++i;
+        } else if (!strcmp(arg, "--overlap")) {
+            options.overlap = true;
+        } else if (!strcmp(arg, "--set-baud") && value) {
+            options.set_baud = strtoul(value, nullptr, 0);
+            ++i;
+        } else if (!strcmp(arg, "--broadcast")) {
+            options.broadcast = true;
+        } else if (!strcmp(arg, "--lz4")) {
+            options.lz4 = true;
+        } else if (!strcmp(arg, "--diff")) {
+            options.diff = true;
+        } else if (!strcmp(arg, "--delta")) {
+            options.delta = true;
+        } else if (!strcmp(arg, "--patch") && value) {
+            patch = strtoul(value, nullptr, 0);
+            preload = true;
+            ++i;
+        } else if (!strcmp(arg, "--preload")) {
+            preload = true;
+        } else if (!strcmp(arg, "--boot-check")) {
+            options.boot_check = true;
+        } else if (!strcmp(arg, "--crc32")) {
+            crc32 = true;
+        } else if (!strcmp(arg, "--full-check")) {
+            options.full_check = true;
+        } else if (!strcmp(arg, "--warm")) {
+            preload = true;
+            warm = true;
+        } else if (!strcmp(arg, "--flaky") && value) {
+            sim::flaky_program = strtoul(value, nullptr, 0);
+            ++i;
+        } else if (!strcmp(arg, "--trace") && value) {
+            if (!sim::openTrace(value)) {
+                perror(value);
+                return 2;
+            }
+            ++i;
+        } else if (!strcmp(arg, "--boot-budget") && value) {
+            boot_budget = strtoul(value, nullptr, 0);
+            ++i;
+        } else if (!strcmp(arg, "--stats")) {
+            options.stats = true;
+        } else if (!strcmp(arg, "--csv")) {
+            csv = true;
+        } else if (!strcmp(arg, "--csv-header")) {
+            printf("board,family,image_bytes,preloaded,frames,total_ms,wire_ms,turnaround_ms,cpu_ms,"
+                   "erase_ms,program_ms,hash_ms,erases,write_ms,start_ms,throughput_kib_s\n");
+            return 0;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (used > SelfProgram::applicationSize || options.chunk <= (options.window ? 2 : 0)
+        || options.chunk > MAX_PACKET_LENGTH - 8
+        || (options.overlap && !options.window)
+        || (options.full_check && !options.boot_check)
+        || (crc32 && path)
+        || (options.diff && (options.window || options.lz4 || options.delta))
+        || (options.broadcast && (options.window || options.lz4 || options.delta || options.diff)))
+        usage(argv[0]);
+#if defined(STM32F4)
+    if (options.diff) {
+        // The first write to a sector erases the unchanged pages in it too
+        fprintf(stderr, "sim: --diff is not supported, STM32F4 erases whole sectors\n");
+        return 2;
+    }
+    if (options.delta) {
+        // Copies would read from sectors the first write already erased
+        fprintf(stderr, "sim: --delta is not supported, STM32F4 erases whole sectors\n");
+        return 2;
+    }
+#endif
+    if ((options.boot_check || warm) && !crc32 && !path
+        && puppy_crash_dump::APP_DESCRIPTOR_OFFSET < SelfProgram::applicationSize - FW_DESCRIPTOR_SIZE) {
+        // The unsalted fingerprint would cover the descriptor that holds it
+        fprintf(stderr, "sim: the descriptor lies inside the fingerprinted range on this board,"
+                        " --boot-check and --warm need --crc32\n");
+        return 2;
+    }
+
+    std::vector<uint8_t> image = path ? loadImage(path) : generateImage(used, crc32);
+    if (crc32) {
+        // crc32Hw() charged the puppy for building the descriptor
+        sim::restart();
+    }
+    uint8_t *app = sim::flash() + FLASH_APP_OFFSET;
+    if (preload)
+        memcpy(app, image.data(), image.size());
+    if (warm) {
+        // The previous boot checked the image and left its record in the
+        // backup registers, which survive the reset
+        const auto *descriptor = reinterpret_cast<const puppy_crash_dump::FWDescriptor *>(app + puppy_crash_dump::APP_DESCRIPTOR_OFFSET);
+        if (!SelfProgram::checkVerifiedFingerprint(descriptor->fingerprint, true)) {
+            fprintf(stderr, "sim: --warm needs an image that passes the boot check\n");
+            return 2;
+        }
+        sim::restart();
+    }
+    if (patch) {
+        // A changed function, with the code behind it moving down
+        const uint32_t at = image.size() / 4;
+        const uint32_t removed = 64;
+        if (at + patch + removed > image.size())
+            usage(argv[0]);
+        for (uint32_t i = 0; i < patch; ++i)
+            image[at + i] ^= 0x5a;
+        image.erase(image.begin() + at + patch, image.begin() + at + patch + removed);
+        image.insert(image.end(), removed, 0xff);
+    }
+
+    sim::Master master(options, image);
+    current_master = &master;
+
+    runBootloader();
+    sim::drainTrace();
+    startApplication();
+
+    if (memcmp(app, image.data(), image.size()) != 0) {
+        fprintf(stderr, "sim: flash content differs from the uploaded image\n");
+        return 1;
+    }
+
+    const BootProfile &boot = application_startup_arguments.boot_profile;
+    if (boot_budget && boot.total > boot_budget) {
+        fprintf(stderr, "sim: boot took %u us, over the budget of %u us\n", boot.total, boot_budget);
+        return 1;
+    }
+
+    using sim::Cost;
+    using Phase = sim::Master::Phase;
+    const uint64_t total = sim::now();
+    const uint64_t write = master.phaseEnd(Phase::finalize) - master.phaseEnd(Phase::info);
+    const double throughput = image.size() / 1024.0 / (total / 1e9);
+
+    if (csv) {
+        printf("%s,%s,%zu,%d,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%u,%.3f,%.3f,%.2f\n",
+            SIM_BOARD, sim::family.name, image.size(), preload, sim::counters.frames, ms(total),
+            ms(sim::spent(Cost::wire)), ms(sim::spent(Cost::turnaround)), ms(sim::spent(Cost::cpu)),
+            ms(sim::spent(Cost::erase)), ms(sim::spent(Cost::program)), ms(sim::spent(Cost::hash)),
+            sim::counters.erases, ms(write), ms(total - master.phaseEnd(Phase::finalize)), throughput);
+        return 0;
+    }
+
+    printf("board       %s (%s, %u MHz)\n", SIM_BOARD, sim::family.name, sim::family.cpu_hz / 1000000);
+#if defined(CLOCK_BOOST)
+    printf("            (%u MHz boosted for the flash and hash work)\n", sim::family.boost_hz / 1000000);
+#endif
+    printf("image       %zu bytes, %s flash, %u baud\n", image.size(), preload ? "preloaded" : "blank", sim::link.baud);
+    if (options.set_baud)
+        printf("            (switched from %u baud with SET_BAUD)\n", BUS_DEFAULT_BAUD_RATE);
+    printf("frames      %u (%u bytes out, %u bytes back)\n", sim::counters.frames, sim::counters.bytes_tx, sim::counters.bytes_rx);
+    if (options.broadcast)
+        printf("broadcast   %u rewinds, %u frames lost to overruns\n", master.nackCount(), sim::counters.lost);
+    if (options.window)
+        printf("window      %u frames, %u NACKs, %u frames lost to overruns\n", options.window, master.nackCount(), sim::counters.lost);
+    if (sim::flaky_program)
+        printf("verify      %u pages sent again\n", master.resendCount());
+    printf("total       %10.3f ms, %.2f KiB/s\n", ms(total), throughput);
+    printf("  wire      %10.3f ms\n", ms(sim::spent(Cost::wire)));
+    printf("  turnaround%10.3f ms\n", ms(sim::spent(Cost::turnaround)));
+    printf("  cpu       %10.3f ms\n", ms(sim::spent(Cost::cpu)));
+    printf("  erase     %10.3f ms (%u erases)\n", ms(sim::spent(Cost::erase)), sim::counters.erases);
+    printf("  program   %10.3f ms (%u units)\n", ms(sim::spent(Cost::program)), sim::counters.programs);
+    printf("  hash      %10.3f ms (%u bytes)\n", ms(sim::spent(Cost::hash)), sim::counters.hashed);
+    printf("phases\n");
+    printf("  write     %10.3f ms (WRITE_FLASH..FINALIZE_FLASH)\n", ms(write));
+    printf("  start     %10.3f ms (fingerprint and START_APPLICATION)\n", ms(total - master.phaseEnd(Phase::finalize)));
+    if (options.stats) {
+        const Stats &s = master.puppyStats();
+#if defined(CLOCK_BOOST)
+        // Counted at the clock running at the time, boosted unless the
+        // pages came with WRITE_FLASH_STREAM before FINALIZE_FLASH
+        const double cycles_per_ms = sim::family.boost_hz / 1000.0;
+#else
+        const double cycles_per_ms = sim::family.cpu_hz / 1000.0;
+#endif
+        printf("stats       %u CRC errors, %u line errors, %u frames lost\n", s.crcErrors, s.lineErrors, s.framesLost);
+        printf("            %u bytes received, %u bytes committed\n", s.bytesReceived, s.bytesCommitted);
+        printf("            %u pages skipped, %u erased\n", s.pagesSkipped, s.pagesErased);
+        printf("            erase %.3f ms, program %.3f ms, hash %.3f ms\n", s.eraseCycles / cycles_per_ms,
+            s.programCycles / cycles_per_ms, s.hashCycles / cycles_per_ms);
+    }
+    printf("boot        %10.3f ms until the application starts\n", boot.total / 1000.0);
+    printf("  clock     %10.3f ms\n", boot.clock_init / 1000.0);
+    printf("  bus       %10.3f ms\n", boot.bus_init / 1000.0);
+    printf("  watchdog  %10.3f ms\n", boot.watchdog_start / 1000.0);
+    printf("  power     %10.3f ms (power panic)\n", boot.power_panic / 1000.0);
+    printf("  led       %10.3f ms\n", boot.led / 1000.0);
+    printf("  frame     %10.3f ms (until the first frame was handled)\n", boot.first_frame / 1000.0);
+    printf("  check     %10.3f ms (unsalted fingerprint or CRC-32)\n", boot.fingerprint_check / 1000.0);
+    printf("  deinit    %10.3f ms\n", boot.deinit / 1000.0);
+    printf("latency     count      avg ms      max ms\n");
+    static const struct {
+        uint8_t cmd;
+        const char *name;
+    } commands[] = {
+        { sim::Cmd::WRITE_FLASH, "WRITE_FLASH" },
+        { sim::Cmd::WRITE_FLASH_STREAM, "WRITE_FLASH_STREAM" },
+        { sim::Cmd::WRITE_FLASH_LZ4, "WRITE_FLASH_LZ4" },
+        { sim::Cmd::WRITE_FLASH_DELTA, "WRITE_FLASH_DELTA" },
+        { sim::Cmd::GET_WRITE_STATUS, "GET_WRITE_STATUS" },
+        { sim::Cmd::FINALIZE_FLASH, "FINALIZE_FLASH" },
+        { sim::Cmd::COMPUTE_FINGERPRINT, "COMPUTE_FINGERPRINT" },
+        { sim::Cmd::GET_FINGERPRINT, "GET_FINGERPRINT" },
+        { sim::Cmd::GET_STATS, "GET_STATS" },
+        { sim::Cmd::START_APPLICATION, "START_APPLICATION" },
+    };
+    for (const auto &c : commands) {
+        const sim::Master::Latency &l = master.latency(c.cmd);
+        if (l.count)
+            printf("  %-20s %6u %11.3f %11.3f\n", c.name, l.count, ms(l.total_ns / l.count), ms(l.max_ns));
+    }
+    return 0;
+}
@@ -0,0 +1,3 @@
+#include "power_panic.hpp"
+
+void WaitForEndOfPowerPanic() {}
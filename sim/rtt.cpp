@@ -0,0 +1,13 @@
+#include "rtt.hpp"
+#include "Sim.h"
+
+// No debugger to read the text, the trace channel goes to the file of
+// --trace
+void rtt::init() {}
+void rtt::print(char) {}
+void rtt::print(const char *) {}
+void rtt::print(uint32_t) {}
+
+void rtt::drainTrace() {
+    sim::drainTrace();
+}
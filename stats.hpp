@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+
+/// Counters since reset, for the master to judge the health of the link
+/// and the flash of a puppy (see GET_STATS in bootloader.cpp). All wrap
+/// around. The bus drivers may count from their interrupt handler, the
+/// rest is counted from the main loop.
+struct Stats {
+    uint32_t crcErrors;         ///< Frames BusCallback dropped for a bad CRC
+    uint32_t lineErrors;        ///< Frames dropped for a parity, framing or overrun error
+    uint32_t framesLost;        ///< Frames dropped because the receive buffer or ring was full
+    uint32_t bytesReceived;     ///< Bytes of the frames handed to BusCallback
+    uint32_t bytesCommitted;    ///< Bytes of the pages committed to flash
+    uint32_t pagesSkipped;      ///< Pages committed that were equal to the flash already
+    uint32_t pagesErased;       ///< Pages (STM32F4: sectors) erased
+    uint32_t reserved;          ///< Keeps the cycles aligned, with -fpack-struct or not
+    uint64_t eraseCycles;       ///< CPU cycles spent erasing (see trace::cycles()), at the clock of the time (see ClockBoost())
+    uint64_t programCycles;     ///< CPU cycles spent programming
+    uint64_t hashCycles;        ///< CPU cycles spent hashing flash
+};
+static_assert(sizeof(Stats) == 56, "The bootloader is built with -fpack-struct, the simulator is not");
+
+extern Stats stats;
@@ -0,0 +1,44 @@
+#include "Crc.h"
+
+#if defined(STM32H5)
+    #include <stm32h5xx.h>
+#elif defined(STM32C0)
+    #include <stm32c0xx.h>
+#else
+    #error
+#endif
+
+// CRC-16/MODBUS on the CRC peripheral: polynomial 0x8005, input
+// reflected per byte, output reflected. The clock is only enabled while
+// calculating, like preboot does. Gating the clock keeps POL, INIT and CR,
+// so the peripheral is reset before, and the application finds it the way
+// it left reset.
+uint16_t crc16IbmUpdateHw(uint16_t crc, const uint8_t *buf, uint8_t len) {
+#if defined(STM32H5)
+    SET_BIT(RCC->AHB1ENR, RCC_AHB1ENR_CRCEN);
+    (void)READ_REG(RCC->AHB1ENR); // dummy read to enforce delay
+#else
+    SET_BIT(RCC->AHBENR, RCC_AHBENR_CRCEN);
+    (void)READ_REG(RCC->AHBENR); // dummy read to enforce delay
+#endif
+
+    WRITE_REG(CRC->POL, 0x8005);
+    WRITE_REG(CRC->INIT, crc16Reverse(crc));
+    WRITE_REG(CRC->CR, CRC_CR_POLYSIZE_0 | CRC_CR_REV_IN_0 | CRC_CR_REV_OUT | CRC_CR_RESET);
+    while (len > 0) {
+        *reinterpret_cast<__IO uint8_t *>(&CRC->DR) = *buf++;
+        --len;
+    }
+    crc = READ_REG(CRC->DR);
+
+#if defined(STM32H5)
+    SET_BIT(RCC->AHB1RSTR, RCC_AHB1RSTR_CRCRST);
+    CLEAR_BIT(RCC->AHB1RSTR, RCC_AHB1RSTR_CRCRST);
+    CLEAR_BIT(RCC->AHB1ENR, RCC_AHB1ENR_CRCEN);
+#else
+    SET_BIT(RCC->AHBRSTR, RCC_AHBRSTR_CRCRST);
+    CLEAR_BIT(RCC->AHBRSTR, RCC_AHBRSTR_CRCRST);
+    CLEAR_BIT(RCC->AHBENR, RCC_AHBENR_CRCEN);
+#endif
+    return crc;
+}
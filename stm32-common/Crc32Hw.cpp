@@ -0,0 +1,54 @@
+#include "Crc.h"
+
+#include <cstring>
+
+#if defined(STM32H5)
+    #include <stm32h5xx.h>
+#elif defined(STM32C0)
+    #include <stm32c0xx.h>
+#elif defined(STM32F4)
+    #include <stm32f4xx.h>
+#else
+    #error
+#endif
+
+// CRC-32/MPEG-2 on the CRC peripheral, in the configuration it comes out
+// of reset with (the only one the F4 has). crc16IbmUpdateHw() changes
+// that, so it is set up again. The clock is only enabled while
+// calculating, like preboot does, and the peripheral is reset before it
+// goes off (gating the clock keeps POL, INIT and CR).
+uint32_t crc32Hw(const uint8_t *buf, uint32_t len) {
+#if defined(STM32C0)
+    SET_BIT(RCC->AHBENR, RCC_AHBENR_CRCEN);
+    (void)READ_REG(RCC->AHBENR); // dummy read to enforce delay
+#else
+    SET_BIT(RCC->AHB1ENR, RCC_AHB1ENR_CRCEN);
+    (void)READ_REG(RCC->AHB1ENR); // dummy read to enforce delay
+#endif
+
+#if defined(STM32F4)
+    WRITE_REG(CRC->CR, CRC_CR_RESET);
+#else
+    WRITE_REG(CRC->POL, 0x04C11DB7);
+    WRITE_REG(CRC->INIT, 0xFFFFFFFF);
+    WRITE_REG(CRC->CR, CRC_CR_RESET);
+#endif
+    for (uint32_t i = 0; i < len; i += 4) {
+        // Unaligned buffers are fine, a partial last word is padded
+        uint32_t word = 0xFFFFFFFF;
+        memcpy(&word, buf + i, len - i < 4 ? len - i : 4);
+        WRITE_REG(CRC->DR, word);
+    }
+    uint32_t crc = READ_REG(CRC->DR);
+
+#if defined(STM32C0)
+    SET_BIT(RCC->AHBRSTR, RCC_AHBRSTR_CRCRST);
+    CLEAR_BIT(RCC->AHBRSTR, RCC_AHBRSTR_CRCRST);
+    CLEAR_BIT(RCC->AHBENR, RCC_AHBENR_CRCEN);
+#else
+    SET_BIT(RCC->AHB1RSTR, RCC_AHB1RSTR_CRCRST);
+    CLEAR_BIT(RCC->AHB1RSTR, RCC_AHB1RSTR_CRCRST);
+    CLEAR_BIT(RCC->AHB1ENR, RCC_AHB1ENR_CRCEN);
+#endif
+    return crc;
+}
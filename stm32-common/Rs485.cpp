@@ -8,27 +8,40 @@
 #include <stm32h5xx_ll_usart.h>
 #include <stm32h5xx_ll_rcc.h>
 #include <stm32h5xx_ll_bus.h>
+#include <stm32h5xx_ll_dma.h>
 #elif defined(STM32C0)
 #include <stm32c0xx_hal.h>
 #include <stm32c0xx_ll_gpio.h>
 #include <stm32c0xx_ll_usart.h>
 #include <stm32c0xx_ll_rcc.h>
 #include <stm32c0xx_ll_bus.h>
+#include <stm32c0xx_ll_dma.h>
 #else
 #error
 #endif
 
+#include "stats.hpp"
+
 #include <cstdint>
 #include <cstring>
 
+#if defined(BUS_USE_INTERRUPTS)
+static void BusInitDma();
+static void BusDeinitDma();
+#endif
+
 #if defined(BOARD_TYPE_prusa_xbuddy_extension)
 #define D_RS485_FLOW_CONTROL_Pin LL_GPIO_PIN_14
 #define D_RS485_FLOW_CONTROL_GPIO_Port GPIOB
 #define USART_CHANNEL USART3
+#define USART_IRQn USART3_IRQn
+#define USART_IRQHandler USART3_IRQHandler
 #elif defined(BOARD_TYPE_prusa_indx_head)
 #define D_RS485_FLOW_CONTROL_Pin LL_GPIO_PIN_9
 #define D_RS485_FLOW_CONTROL_GPIO_Port GPIOB
 #define USART_CHANNEL USART2
+#define USART_IRQn USART2_IRQn
+#define USART_IRQHandler USART2_IRQHandler
 #else
 #error "Undefined modbus channel and flow control gpio"
 #endif
@@ -93,7 +106,7 @@ void BusInit() {
     LL_GPIO_Init(D_RS485_FLOW_CONTROL_GPIO_Port, &GPIO_InitStruct);
 
     USART_InitStruct.PrescalerValue = LL_USART_PRESCALER_DIV1;
-    USART_InitStruct.BaudRate = 230400; // Default puppy baud rate
+    USART_InitStruct.BaudRate = BUS_DEFAULT_BAUD_RATE;
     USART_InitStruct.DataWidth = LL_USART_DATAWIDTH_8B;
     USART_InitStruct.StopBits = LL_USART_STOPBITS_1;
     USART_InitStruct.Parity = LL_USART_PARITY_NONE;
@@ -104,9 +117,9 @@ void BusInit() {
     LL_USART_SetTXFIFOThreshold(USART_CHANNEL, LL_USART_FIFOTHRESHOLD_1_8);
     LL_USART_SetRXFIFOThreshold(USART_CHANNEL, LL_USART_FIFOTHRESHOLD_1_8);
 #if HAS_RX_TIMEOUT_INTERUPT()
-    LL_USART_SetRxTimeout(USART_CHANNEL, 35); // Acording to modbus spec you should wait 3.5 characters 
-                                              // after sending a message (and also before). We are sending
-                                              // 10 bits per byte, so we wait for 35 bits before timeout.
+    // Acording to modbus spec you should wait 3.5 characters after sending a message (and also before).
+    // We are sending 10 bits per byte, so we wait for 35 bits before timeout at the default rate.
+    LL_USART_SetRxTimeout(USART_CHANNEL, BusInterFrameBits(BUS_DEFAULT_BAUD_RATE));
     LL_USART_EnableRxTimeout(USART_CHANNEL);
 #endif
     LL_USART_DisableFIFO(USART_CHANNEL);
@@ -115,6 +128,10 @@ void BusInit() {
 
     while (!LL_USART_IsActiveFlag_TEACK(USART_CHANNEL) || !LL_USART_IsActiveFlag_REACK(USART_CHANNEL)) { }
 
+#if defined(BUS_USE_INTERRUPTS)
+    BusInitDma();
+#endif
+
 
     // We want to enable auto baud rate detection, since testers are unable to run on 230 400
     // LL_USART_SetAutoBaudRateMode(USART_CHANNEL, LL_USART_AUTOBAUD_DETECT_ON_STARTBIT);
@@ -122,20 +139,324 @@ void BusInit() {
 }
 
 void BusDeinit() {
+#if defined(BUS_USE_INTERRUPTS)
+    BusDeinitDma();
+#endif
     LL_USART_Disable(USART_CHANNEL);
     LL_USART_DeInit(USART_CHANNEL);
 }
 
 static uint8_t busBuffer[MAX_PACKET_LENGTH];
 static uint8_t busBufferLen = 0;
-static uint8_t busTxPos = 0;
-static uint8_t busAddress = 0;
 static_assert(MAX_PACKET_LENGTH < (1 << (sizeof(busBufferLen) * 8)), "Code needs changes for bigger packets");
 
 static bool matchAddress(uint8_t address) {
-	return address == getConfiguredAddress();
+	return address == getConfiguredAddress() || address == BROADCAST_ADDRESS;
+}
+
+static uint32_t busBaudRate = BUS_DEFAULT_BAUD_RATE;
+static uint32_t busNextBaudRate = 0;     ///< Rate to switch to once the reply is sent
+static uint32_t busFallbackBaudRate = 0; ///< Rate to restore unless a frame is confirmed in time
+static uint32_t busFallbackStart = 0;
+
+static void setBaudRate(uint32_t baud) {
+    // BRR can only be written with the USART disabled
+    LL_USART_Disable(USART_CHANNEL);
+    LL_USART_SetBaudRate(USART_CHANNEL, HAL_RCC_GetPCLK1Freq(), LL_USART_PRESCALER_DIV1, LL_USART_OVERSAMPLING_16, baud);
+#if HAS_RX_TIMEOUT_INTERUPT()
+    LL_USART_SetRxTimeout(USART_CHANNEL, BusInterFrameBits(baud));
+#endif
+    LL_USART_Enable(USART_CHANNEL);
+    while (!LL_USART_IsActiveFlag_TEACK(USART_CHANNEL) || !LL_USART_IsActiveFlag_REACK(USART_CHANNEL)) { }
+    busBaudRate = baud;
+}
+
+bool BusSetBaudRate(uint32_t baud) {
+    if (baud < BUS_MIN_BAUD_RATE || baud > HAL_RCC_GetPCLK1Freq() / 16) {
+        return false;
+    }
+    busNextBaudRate = baud;
+    return true;
+}
+
+void BusConfirmBaudRate() {
+    busFallbackBaudRate = 0;
+}
+
+#if defined(CLOCK_BOOST)
+void BusClockChanged() {
+    setBaudRate(busBaudRate);
+}
+#endif
+
+/// The last byte of a reply left the shift register
+static void replySent() {
+    if (busNextBaudRate) {
+        busFallbackBaudRate = busBaudRate;
+        busFallbackStart = HAL_GetTick();
+        setBaudRate(busNextBaudRate);
+        busNextBaudRate = 0;
+    }
 }
 
+/// Restore the previous rate if the master did not follow, only called
+/// between frames
+static void checkBaudRateFallback() {
+    if (busFallbackBaudRate && HAL_GetTick() - busFallbackStart >= BUS_BAUD_FALLBACK_MS) {
+        setBaudRate(busFallbackBaudRate);
+        busFallbackBaudRate = 0;
+    }
+}
+
+#if defined(BUS_USE_INTERRUPTS)
+
+// Receive DMA runs circularly over busRing and never stops, so bytes keep
+// coming in while the CPU is stalled on a flash erase or busy hashing. The
+// USART interrupt only marks the frame boundaries, BusUpdate() copies the
+// frames out and processes them in the main loop.
+//
+// Transmit DMA sends busBuffer, the USART interrupt releases the bus once
+// the last byte left the shift register.
+
+#if defined(STM32H5)
+#define RX_DMA GPDMA1, LL_DMA_CHANNEL_0
+#define TX_DMA GPDMA1, LL_DMA_CHANNEL_1
+#elif defined(STM32C0)
+#define RX_DMA DMA1, LL_DMA_CHANNEL_1
+#define TX_DMA DMA1, LL_DMA_CHANNEL_2
+#endif
+
+struct RxFrame {
+    uint32_t start; ///< Bytes received before the frame, see busRxMark
+    uint16_t len;
+};
+
+static uint8_t busRing[BUS_RX_RING_SIZE];
+/// Bytes received before the frame being received starts, modulo 2^32 (the
+/// ring offset in the low bits). Counting past the ring size tells
+/// BusUpdate() whether the DMA came round over a queued frame.
+static volatile uint32_t busRxMark = 0;
+/// Single producer (interrupt), single consumer (BusUpdate) queue
+static RxFrame busRxFrames[BUS_RX_FRAMES + 1];
+static volatile uint8_t busRxHead = 0;
+static volatile uint8_t busRxTail = 0;
+static volatile bool busTransmitting = false;
+
+#if defined(STM32H5)
+/// Linked-list node reloading the block size and destination address, so
+/// the channel starts over at the beginning of the ring (GPDMA has no
+/// circular mode).
+alignas(4) static uint32_t busRxNode[3];
+#endif
+
+static void BusInitDma() {
+#if defined(STM32H5)
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_GPDMA1);
+
+    busRxNode[0] = sizeof(busRing);
+    busRxNode[1] = reinterpret_cast<uint32_t>(busRing);
+    busRxNode[2] = DMA_CLLR_UB1 | DMA_CLLR_UDA | DMA_CLLR_ULL | (reinterpret_cast<uint32_t>(busRxNode) & DMA_CLLR_LA);
+
+    LL_DMA_SetPeriphRequest(RX_DMA, LL_GPDMA1_REQUEST_USART3_RX);
+    LL_DMA_SetDataTransferDirection(RX_DMA, LL_DMA_DIRECTION_PERIPH_TO_MEMORY);
+    LL_DMA_SetSrcIncMode(RX_DMA, LL_DMA_SRC_FIXED);
+    LL_DMA_SetDestIncMode(RX_DMA, LL_DMA_DEST_INCREMENT);
+    LL_DMA_SetSrcDataWidth(RX_DMA, LL_DMA_SRC_DATAWIDTH_BYTE);
+    LL_DMA_SetDestDataWidth(RX_DMA, LL_DMA_DEST_DATAWIDTH_BYTE);
+    LL_DMA_ConfigAddresses(RX_DMA, LL_USART_DMA_GetRegAddr(USART_CHANNEL, LL_USART_DMA_REG_DATA_RECEIVE),
+        reinterpret_cast<uint32_t>(busRing));
+    LL_DMA_SetBlkDataLength(RX_DMA, sizeof(busRing));
+    LL_DMA_SetLinkedListBaseAddr(RX_DMA, reinterpret_cast<uint32_t>(busRxNode));
+    LL_DMA_ConfigLinkUpdate(RX_DMA, LL_DMA_UPDATE_CBR1 | LL_DMA_UPDATE_CDAR | LL_DMA_UPDATE_CLLR,
+        reinterpret_cast<uint32_t>(busRxNode));
+
+    LL_DMA_SetPeriphRequest(TX_DMA, LL_GPDMA1_REQUEST_USART3_TX);
+    LL_DMA_SetDataTransferDirection(TX_DMA, LL_DMA_DIRECTION_MEMORY_TO_PERIPH);
+    LL_DMA_SetSrcIncMode(TX_DMA, LL_DMA_SRC_INCREMENT);
+    LL_DMA_SetDestIncMode(TX_DMA, LL_DMA_DEST_FIXED);
+    LL_DMA_SetSrcDataWidth(TX_DMA, LL_DMA_SRC_DATAWIDTH_BYTE);
+    LL_DMA_SetDestDataWidth(TX_DMA, LL_DMA_DEST_DATAWIDTH_BYTE);
+    LL_DMA_ConfigAddresses(TX_DMA, reinterpret_cast<uint32_t>(busBuffer),
+        LL_USART_DMA_GetRegAddr(USART_CHANNEL, LL_USART_DMA_REG_DATA_TRANSMIT));
+#elif defined(STM32C0)
+    LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_DMA1);
+
+    LL_DMA_SetPeriphRequest(RX_DMA, LL_DMAMUX_REQ_USART2_RX);
+    LL_DMA_SetDataTransferDirection(RX_DMA, LL_DMA_DIRECTION_PERIPH_TO_MEMORY);
+    LL_DMA_SetMode(RX_DMA, LL_DMA_MODE_CIRCULAR);
+    LL_DMA_SetPeriphIncMode(RX_DMA, LL_DMA_PERIPH_NOINCREMENT);
+    LL_DMA_SetMemoryIncMode(RX_DMA, LL_DMA_MEMORY_INCREMENT);
+    LL_DMA_SetPeriphSize(RX_DMA, LL_DMA_PDATAALIGN_BYTE);
+    LL_DMA_SetMemorySize(RX_DMA, LL_DMA_MDATAALIGN_BYTE);
+    LL_DMA_ConfigAddresses(RX_DMA, LL_USART_DMA_GetRegAddr(USART_CHANNEL, LL_USART_DMA_REG_DATA_RECEIVE),
+        reinterpret_cast<uint32_t>(busRing), LL_DMA_DIRECTION_PERIPH_TO_MEMORY);
+    LL_DMA_SetDataLength(RX_DMA, sizeof(busRing));
+
+    LL_DMA_SetPeriphRequest(TX_DMA, LL_DMAMUX_REQ_USART2_TX);
+    LL_DMA_SetDataTransferDirection(TX_DMA, LL_DMA_DIRECTION_MEMORY_TO_PERIPH);
+    LL_DMA_SetMode(TX_DMA, LL_DMA_MODE_NORMAL);
+    LL_DMA_SetPeriphIncMode(TX_DMA, LL_DMA_PERIPH_NOINCREMENT);
+    LL_DMA_SetMemoryIncMode(TX_DMA, LL_DMA_MEMORY_INCREMENT);
+    LL_DMA_SetPeriphSize(TX_DMA, LL_DMA_PDATAALIGN_BYTE);
+    LL_DMA_SetMemorySize(TX_DMA, LL_DMA_MDATAALIGN_BYTE);
+    LL_DMA_ConfigAddresses(TX_DMA, reinterpret_cast<uint32_t>(busBuffer),
+        LL_USART_DMA_GetRegAddr(USART_CHANNEL, LL_USART_DMA_REG_DATA_TRANSMIT), LL_DMA_DIRECTION_MEMORY_TO_PERIPH);
+#endif
+    LL_DMA_EnableChannel(RX_DMA);
+
+    LL_USART_EnableDMAReq_RX(USART_CHANNEL);
+    LL_USART_EnableDMAReq_TX(USART_CHANNEL);
+    // Errors don't stop the receive DMA, they are collected per frame
+    LL_USART_DisableDMADeactOnRxErr(USART_CHANNEL);
+#if HAS_RX_TIMEOUT_INTERUPT()
+    LL_USART_EnableIT_RTO(USART_CHANNEL);
+#else
+    LL_USART_EnableIT_IDLE(USART_CHANNEL);
+#endif
+    NVIC_SetPriority(USART_IRQn, 0);
+    NVIC_EnableIRQ(USART_IRQn);
+}
+
+static void BusDeinitDma() {
+    NVIC_DisableIRQ(USART_IRQn);
+    NVIC_ClearPendingIRQ(USART_IRQn);
+    LL_USART_DisableDMAReq_RX(USART_CHANNEL);
+    LL_USART_DisableDMAReq_TX(USART_CHANNEL);
+    LL_DMA_DisableChannel(RX_DMA);
+    LL_DMA_DisableChannel(TX_DMA);
+}
+
+/// Offset in busRing the receive DMA writes to next
+static uint16_t rxPosition() {
+#if defined(STM32H5)
+    const uint16_t remaining = LL_DMA_GetBlkDataLength(RX_DMA);
+#elif defined(STM32C0)
+    const uint16_t remaining = LL_DMA_GetDataLength(RX_DMA);
+#endif
+    return (sizeof(busRing) - remaining) & (sizeof(busRing) - 1);
+}
+
+/// Bytes received so far, in the count of busRxMark
+static uint32_t rxCount() {
+    const uint32_t mark = busRxMark;
+    return mark + ((rxPosition() - mark) & (sizeof(busRing) - 1));
+}
+
+extern "C" void USART_IRQHandler() {
+    if (LL_USART_IsEnabledIT_TC(USART_CHANNEL) && LL_USART_IsActiveFlag_TC(USART_CHANNEL)) {
+        LL_USART_DisableIT_TC(USART_CHANNEL);
+        LL_USART_ClearFlag_TC(USART_CHANNEL);
+        LL_GPIO_ResetOutputPin(D_RS485_FLOW_CONTROL_GPIO_Port, D_RS485_FLOW_CONTROL_Pin);
+
+        // Whatever came in while the transceiver was driving the bus is
+        // not a request
+        busRxMark = rxCount();
+        LL_USART_ClearFlag_IDLE(USART_CHANNEL);
+        LL_USART_ClearFlag_RTO(USART_CHANNEL);
+        replySent();
+        busTransmitting = false;
+        return;
+    }
+
+#if HAS_RX_TIMEOUT_INTERUPT()
+    if (!LL_USART_IsActiveFlag_RTO(USART_CHANNEL)) {
+        return;
+    }
+#else
+    if (!LL_USART_IsActiveFlag_IDLE(USART_CHANNEL)) {
+        return;
+    }
+#endif
+    LL_USART_ClearFlag_IDLE(USART_CHANNEL);
+    LL_USART_ClearFlag_RTO(USART_CHANNEL);
+
+    const bool rxok = !LL_USART_IsActiveFlag_PE(USART_CHANNEL)
+        && !LL_USART_IsActiveFlag_FE(USART_CHANNEL)
+        && !LL_USART_IsActiveFlag_ORE(USART_CHANNEL);
+    LL_USART_ClearFlag_FE(USART_CHANNEL);
+    LL_USART_ClearFlag_PE(USART_CHANNEL);
+    LL_USART_ClearFlag_ORE(USART_CHANNEL);
+
+    const uint32_t start = busRxMark;
+    const uint32_t end = rxCount();
+    const uint16_t len = end - start;
+    busRxMark = end;
+
+    const uint8_t head = busRxHead;
+    const uint8_t next = head == BUS_RX_FRAMES ? 0 : head + 1;
+    const uint8_t tail = busRxTail;
+    if (len == 0) {
+        return;
+    }
+    // The DMA keeps writing while the queue is full, so a frame only fits
+    // if it ends at most a ring away from the oldest frame not copied out
+    const bool fits = next != tail
+        && (tail == head || end - busRxFrames[tail].start <= sizeof(busRing));
+    if (!rxok) {
+        ++stats.lineErrors;
+    } else if (len > 1 && matchAddress(busRing[start & (sizeof(busRing) - 1)])) {
+        if (len <= MAX_PACKET_LENGTH + 1 && fits) {
+            busRxFrames[head].start = start;
+            busRxFrames[head].len = len;
+            busRxHead = next;
+        } else {
+            ++stats.framesLost;
+        }
+    }
+}
+
+bool BusUpdate() {
+    if (busTransmitting) {
+        return true;
+    }
+    const uint8_t tail = busRxTail;
+    if (tail == busRxHead) {
+        checkBaudRateFallback();
+        return false;
+    }
+
+    // Copy the frame out of the ring first, so the slot is free for the
+    // next one while this one is processed
+    const RxFrame frame = busRxFrames[tail];
+    const uint8_t address = busRing[frame.start & (sizeof(busRing) - 1)];
+    busBufferLen = frame.len - 1;
+    for (uint8_t i = 0; i < busBufferLen; ++i) {
+        busBuffer[i] = busRing[(frame.start + 1 + i) & (sizeof(busRing) - 1)];
+    }
+    busRxTail = tail == BUS_RX_FRAMES ? 0 : tail + 1;
+
+    // Frames not admitted (full queue, other addresses, line errors) still
+    // went through the ring and may have overwritten this one meanwhile
+    if (rxCount() - frame.start > sizeof(busRing)) {
+        ++stats.framesLost;
+        return true;
+    }
+
+    busBufferLen = BusCallback(address, busBuffer, busBufferLen, sizeof(busBuffer));
+    if (busBufferLen > 0) {
+        busTransmitting = true;
+        LL_GPIO_SetOutputPin(D_RS485_FLOW_CONTROL_GPIO_Port, D_RS485_FLOW_CONTROL_Pin);
+#if defined(STM32H5)
+        LL_DMA_ClearFlag_TC(TX_DMA);
+        // The source address advanced with the previous reply
+        LL_DMA_SetSrcAddress(TX_DMA, reinterpret_cast<uint32_t>(busBuffer));
+        LL_DMA_SetBlkDataLength(TX_DMA, busBufferLen);
+#elif defined(STM32C0)
+        LL_DMA_DisableChannel(TX_DMA);
+        LL_DMA_SetDataLength(TX_DMA, busBufferLen);
+#endif
+        LL_USART_ClearFlag_TC(USART_CHANNEL);
+        LL_USART_EnableIT_TC(USART_CHANNEL);
+        LL_DMA_EnableChannel(TX_DMA);
+    }
+    return true;
+}
+
+#else
+
+static uint8_t busTxPos = 0;
+static uint8_t busAddress = 0;
+
 enum class State {
     /// Wait for byte to appear on the bus.
     /// Doesn't use any state variable.
@@ -171,6 +492,7 @@ static State state_idle(const State state) {
             return State::discard;
         }
     } else {
+        checkBaudRateFallback();
         return state; // keep waiting for receive buffer not empty
     }
 }
@@ -211,6 +533,7 @@ static State state_read(const State state) {
         LL_USART_ClearFlag_ORE(USART_CHANNEL);
         LL_USART_ClearFlag_RTO(USART_CHANNEL);
         if (!rxok) {
+            ++stats.lineErrors;
             busBufferLen = 0;
         } else if (busBufferLen != 0) {
             busBufferLen = BusCallback(busAddress, busBuffer, busBufferLen, sizeof(busBuffer));
@@ -228,6 +551,7 @@ static State state_read(const State state) {
             busBuffer[busBufferLen++] = data;
             return state; // read next byte
         } else {
+            ++stats.framesLost;
             return State::discard;
         }
     }
@@ -256,6 +580,7 @@ static State state_finish_write(const State state) {
         LL_USART_ClearFlag_TC(USART_CHANNEL);
 
         LL_GPIO_ResetOutputPin(D_RS485_FLOW_CONTROL_GPIO_Port, D_RS485_FLOW_CONTROL_Pin);
+        replySent();
         return State::idle;
     } else {
         return state; // keep waiting for transmission complete
@@ -286,3 +611,5 @@ bool BusUpdate() {
     busState = get_next_state(busState);
     return busState != State::idle;
 }
+
+#endif // defined(BUS_USE_INTERRUPTS)
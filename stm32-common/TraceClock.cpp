@@ -0,0 +1,52 @@
+#include "trace.hpp"
+
+#if defined(STM32H5)
+    #include <stm32h5xx.h>
+#elif defined(STM32C0)
+    #include <stm32c0xx.h>
+    #include <stm32c0xx_hal.h>
+#elif defined(STM32F4)
+    #include <stm32f4xx.h>
+#else
+    #error
+#endif
+
+#if defined(STM32C0)
+
+// The Cortex-M0+ has no cycle counter. SysTick already interrupts every
+// millisecond for the HAL tick (see HAL_InitTick()), its count fills in
+// the cycles in between.
+uint32_t trace::startCycles() {
+    return SystemCoreClock / 1000000;
+}
+
+void trace::stopCycles() {
+}
+
+uint32_t trace::cycles() {
+    uint32_t tick, value;
+    do {
+        tick = HAL_GetTick();
+        value = SysTick->VAL;
+    } while (tick != HAL_GetTick());
+    return tick * (SysTick->LOAD + 1) + (SysTick->LOAD - value);
+}
+
+#else
+
+uint32_t trace::startCycles() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    return SystemCoreClock / 1000000;
+}
+
+void trace::stopCycles() {
+    DWT->CTRL &= ~DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint32_t trace::cycles() {
+    return DWT->CYCCNT;
+}
+
+#endif
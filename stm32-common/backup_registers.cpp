@@ -0,0 +1,79 @@
+#include "backup_registers.hpp"
+
+#if defined(STM32H5)
+    #include <stm32h5xx.h>
+#elif defined(STM32C0)
+    #include <stm32c0xx.h>
+#elif defined(STM32F4)
+    #include <stm32f4xx.h>
+#else
+    #error
+#endif
+
+// H5: TAMP_BKP28R..31R, C0: PWR_BKP1R..3R (of four), F4:
+// RTC_BKP16R..19R. Like Crc16Hw.cpp, the clock and the write access are
+// only enabled around the access. Both may already be on (ClockInit()),
+// so they are restored rather than cleared.
+static volatile uint32_t *backup_register(uint8_t index) {
+#if defined(STM32H5)
+    return &(&TAMP->BKP0R)[28 + index];
+#elif defined(STM32C0)
+    return &(&PWR->BKP0R)[1 + index];
+#else
+    return &(&RTC->BKP0R)[16 + index];
+#endif
+}
+
+#if defined(STM32H5)
+    #define BACKUP_CLOCK_REG RCC->APB3ENR
+    #define BACKUP_CLOCK_BIT RCC_APB3ENR_RTCAPBEN
+    #define BACKUP_ACCESS_REG PWR->DBPCR
+    #define BACKUP_ACCESS_BIT PWR_DBPCR_DBP
+#elif defined(STM32C0)
+    // PWR_BKPxR have no write protection
+    #define BACKUP_CLOCK_REG RCC->APBENR1
+    #define BACKUP_CLOCK_BIT RCC_APBENR1_PWREN
+#else
+    #define BACKUP_CLOCK_REG RCC->APB1ENR
+    #define BACKUP_CLOCK_BIT RCC_APB1ENR_PWREN
+    #define BACKUP_ACCESS_REG PWR->CR
+    #define BACKUP_ACCESS_BIT PWR_CR_DBP
+#endif
+
+struct Access {
+    bool clock;
+    bool write;
+};
+
+static Access enable_access() {
+    Access previous = { READ_BIT(BACKUP_CLOCK_REG, BACKUP_CLOCK_BIT) != 0, true };
+    SET_BIT(BACKUP_CLOCK_REG, BACKUP_CLOCK_BIT);
+    (void)READ_REG(BACKUP_CLOCK_REG); // dummy read to enforce delay
+#if defined(BACKUP_ACCESS_REG)
+    previous.write = READ_BIT(BACKUP_ACCESS_REG, BACKUP_ACCESS_BIT) != 0;
+    SET_BIT(BACKUP_ACCESS_REG, BACKUP_ACCESS_BIT);
+#endif
+    return previous;
+}
+
+static void restore_access(Access previous) {
+#if defined(BACKUP_ACCESS_REG)
+    if (!previous.write)
+        CLEAR_BIT(BACKUP_ACCESS_REG, BACKUP_ACCESS_BIT);
+#endif
+    if (!previous.clock)
+        CLEAR_BIT(BACKUP_CLOCK_REG, BACKUP_CLOCK_BIT);
+}
+
+uint32_t read_backup_register(uint8_t index) {
+    const Access previous = enable_access();
+    uint32_t value = *backup_register(index);
+    restore_access(previous);
+    return value;
+}
+
+void write_backup_register(uint8_t index, uint32_t value) {
+    const Access previous = enable_access();
+    *backup_register(index) = value;
+    restore_access(previous);
+}
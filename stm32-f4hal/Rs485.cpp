@@ -1,6 +1,7 @@
 #include "Bus.h"
 #include "BaseProtocol.h"
 #include "Config.h"
+#include "stats.hpp"
 
 #include <stm32f4xx_hal.h>
 #include <stm32f4xx_ll_gpio.h>
@@ -73,7 +74,7 @@ void BusInit() {
 
     /* USART2 setup*/
     USART_InitStruct.Instance = USART_CHANNEL;
-    USART_InitStruct.Init.BaudRate = 230400;
+    USART_InitStruct.Init.BaudRate = BUS_DEFAULT_BAUD_RATE;
     USART_InitStruct.Init.WordLength = UART_WORDLENGTH_8B;
     USART_InitStruct.Init.StopBits = UART_STOPBITS_1;
     USART_InitStruct.Init.Parity = UART_PARITY_NONE;
@@ -100,6 +101,8 @@ static uint8_t busBuffer[MAX_PACKET_LENGTH];
 static uint8_t busBufferLen = 0;
 static uint8_t busTxPos = 0;
 static uint8_t busAddress = 0;
+// More bytes came than fit busBuffer, the frame is dropped
+static bool busOverflow = false;
 static_assert(MAX_PACKET_LENGTH < (1 << (sizeof(busBufferLen) * 8)), "Code needs changes for bigger packets");
 
 enum State {
@@ -113,7 +116,52 @@ static State busState = StateIdle;
 static uint32_t idle_ctr = 0;
 
 static bool matchAddress(uint8_t address) {
-	return address == getConfiguredAddress();
+	return address == getConfiguredAddress() || address == BROADCAST_ADDRESS;
+}
+
+static uint32_t busBaudRate = BUS_DEFAULT_BAUD_RATE;
+static uint32_t busNextBaudRate = 0;     ///< Rate to switch to once the reply is sent
+static uint32_t busFallbackBaudRate = 0; ///< Rate to restore unless a frame is confirmed in time
+static uint32_t busFallbackStart = 0;
+
+static void setBaudRate(uint32_t baud) {
+    // No RX timeout to recompute, the end of a frame is detected by
+    // idle_ctr in BusUpdate()
+    LL_USART_Disable(USART_CHANNEL);
+    LL_USART_SetBaudRate(USART_CHANNEL, HAL_RCC_GetPCLK1Freq(), LL_USART_OVERSAMPLING_16, baud);
+    LL_USART_Enable(USART_CHANNEL);
+    busBaudRate = baud;
+}
+
+bool BusSetBaudRate(uint32_t baud) {
+    if (baud < BUS_MIN_BAUD_RATE || baud > HAL_RCC_GetPCLK1Freq() / 16) {
+        return false;
+    }
+    busNextBaudRate = baud;
+    return true;
+}
+
+void BusConfirmBaudRate() {
+    busFallbackBaudRate = 0;
+}
+
+/// The last byte of a reply left the shift register
+static void replySent() {
+    if (busNextBaudRate) {
+        busFallbackBaudRate = busBaudRate;
+        busFallbackStart = HAL_GetTick();
+        setBaudRate(busNextBaudRate);
+        busNextBaudRate = 0;
+    }
+}
+
+/// Restore the previous rate if the master did not follow, only called
+/// between frames
+static void checkBaudRateFallback() {
+    if (busFallbackBaudRate && HAL_GetTick() - busFallbackStart >= BUS_BAUD_FALLBACK_MS) {
+        setBaudRate(busFallbackBaudRate);
+        busFallbackBaudRate = 0;
+    }
 }
 static volatile uint32_t bytes_received{0};
 static volatile uint32_t bytes_transmitted{0};
@@ -129,6 +177,7 @@ bool BusUpdate() {
             LL_USART_SetTransferDirection(USART_CHANNEL, LL_USART_DIRECTION_TX_RX);
             busState = StateIdle;
             idle_ctr = 0;
+            replySent();
         }
     } else if (LL_USART_IsActiveFlag_RXNE(USART_CHANNEL) && busState != StateWrite) {
         uint8_t data = LL_USART_ReceiveData8(USART_CHANNEL);
@@ -137,10 +186,12 @@ bool BusUpdate() {
             busAddress = data;
             busState = StateRead;
             busBufferLen = 0;
+            busOverflow = false;
         } else if (busBufferLen < sizeof(busBuffer)) {
             busBuffer[busBufferLen++] = data;
         } else {
             // printf("rx ovf\n");
+            busOverflow = true;
         }
         idle_ctr = 0;
     }
@@ -164,7 +215,12 @@ bool BusUpdate() {
         LL_USART_ClearFlag_ORE(USART_CHANNEL);
 
         bool matched = matchAddress(busAddress);
-        if (!rxok || busBufferLen == 0 || !matched) {
+        if (!rxok) {
+            ++stats.lineErrors;
+        } else if (busOverflow && matched) {
+            ++stats.framesLost;
+        }
+        if (!rxok || busOverflow || busBufferLen == 0 || !matched) {
             busBufferLen = 0;
         } else {
             busBufferLen = BusCallback(busAddress, busBuffer, busBufferLen, sizeof(busBuffer));
@@ -178,5 +234,9 @@ bool BusUpdate() {
         }
     }
 
+    if (busState == StateIdle) {
+        checkBaudRateFallback();
+    }
+
     return busState != StateIdle;
 }
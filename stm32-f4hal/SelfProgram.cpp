@@ -1,13 +1,9 @@
 #include <cstring>
 
-#if 1 // Disable printf to save space
-    #include <cstdio>
-#else
-    #define printf(...) do {} while(0)
-#endif
-
 #include "iwdg.hpp"
 #include "SelfProgram.h"
+#include "stats.hpp"
+#include "trace.hpp"
 #include <stm32f427xx.h>
 #include <stm32f4xx_hal_flash.h>
 #include <stm32f4xx_hal_flash_ex.h>
@@ -18,86 +14,133 @@
 static const uint32_t application_start = FLASH_BASE + FLASH_APP_OFFSET;
 
 
-// Output readable error message
-void report_error(uint32_t err) {
-    switch(err) {
-        case HAL_FLASH_ERROR_RD:
-            printf("Read Protection error\n");
-            break;
-        case HAL_FLASH_ERROR_PGS:
-            printf("Programming Sequence error\n");
-            break;
-        case HAL_FLASH_ERROR_PGP:
-            printf("Programming Parallelism error\n");
-            break;
-        case HAL_FLASH_ERROR_PGA:
-            printf("Programming Alignment error\n");
-            break;
-        case HAL_FLASH_ERROR_WRP:
-            printf("Write protection error\n");
-            break;
-        case HAL_FLASH_ERROR_OPERATION:
-            printf("Operation error\n");
-            break;
-        default:
-            printf("Unknown error\n");
-            break;
+
+/** Both banks have 4x16K, 1x64K and 7x128K sectors, numbered 0-11 in bank 1
+ *  and 12-23 in bank 2. Sector 0 holds the bootloader.
+ **/
+static const uint32_t bank_size = 1024 * 1024;
+static const uint8_t sectors_per_bank = 12;
+
+/** Sector holding an application address, with its start and size (also in
+ *  application addresses)
+ **/
+static uint8_t sectorOf(uint32_t address, uint32_t *start, uint32_t *size) {
+    const uint32_t bank = (FLASH_APP_OFFSET + address) / bank_size;
+    const uint32_t offset = (FLASH_APP_OFFSET + address) % bank_size;
+    uint8_t sector;
+    if (offset < 64 * 1024) {
+        *size = 16 * 1024;
+        sector = offset / *size;
+    } else if (offset < 128 * 1024) {
+        *size = 64 * 1024;
+        sector = 4;
+    } else {
+        *size = 128 * 1024;
+        sector = 4 + offset / *size;
     }
-};
+    *start = bank * bank_size + (offset & ~(*size - 1)) - FLASH_APP_OFFSET;
+    return bank * sectors_per_bank + sector;
+}
 
+static bool erasing = false;
+static uint32_t erasedSectors = 0; ///< Bit per sector erased (or found blank) since startErasing()
 
-/** Erase the whole flash except the first sector containing bootloader */
-uint8_t SelfProgram::eraseApplicationFlash() {
-    HAL_FLASH_Unlock();
+// Invalidate the instruction & data cache
+static void resetCaches() {
+    __HAL_FLASH_DATA_CACHE_DISABLE();
+    __HAL_FLASH_INSTRUCTION_CACHE_DISABLE();
+    __HAL_FLASH_DATA_CACHE_RESET();
+    __HAL_FLASH_INSTRUCTION_CACHE_RESET();
+    __HAL_FLASH_INSTRUCTION_CACHE_ENABLE();
+    __HAL_FLASH_DATA_CACHE_ENABLE();
+}
 
-    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_WRPERR | FLASH_FLAG_PGSERR);
+static bool isBlank(uint32_t start, uint32_t size) {
+    const uint32_t *words = reinterpret_cast<const uint32_t *>(application_start + start);
+    for (uint32_t i = 0; i < size / 4; ++i) {
+        if (words[i] != 0xffffffff)
+            return false;
+    }
+    return true;
+}
 
-    /*  One big erase for whole flash except the first sector containing bootloader.
-        This will give us a clean slate to work with.
+/** Erase one sector, unless it is blank already. A 128K sector takes 1-2 s,
+ *  so the watchdog is kicked around each one.
+ **/
+static uint8_t eraseSector(uint8_t sector, uint32_t start, uint32_t size) {
+    if (isBlank(start, size)) {
+        erasedSectors |= 1UL << sector;
+        return 0;
+    }
 
-        This takes ~32s on F427.
-    */
+    SelfProgram::nextWriteGeneration();
+    SelfProgram::pageHashesChanged(start, size);
+
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_WRPERR | FLASH_FLAG_PGSERR);
 
-    uint32_t t0 = HAL_GetTick();
     uint32_t erase_error{0};
-    printf("Erasing sector %d to %d of FLASH_BANK_1\n", 1, 11);
 
     FLASH_EraseInitTypeDef EraseInitStruct = {
         .TypeErase = FLASH_TYPEERASE_SECTORS,
-        .Banks = FLASH_BANK_1,
-        .Sector = 1,
-        .NbSectors = 11,
+        .Banks = sector < sectors_per_bank ? FLASH_BANK_1 : FLASH_BANK_2,
+        .Sector = sector,
+        .NbSectors = 1,
         .VoltageRange = FLASH_VOLTAGE_RANGE_3,
     };
-    if (HAL_FLASHEx_Erase(&EraseInitStruct, &erase_error) != HAL_OK) {
-        printf("Erase failed: %lu\n", erase_error);
+    WatchdogReset();
+    trace::begin(trace::Event::erase, start / FLASH_ERASE_SIZE);
+    const uint32_t cycles = trace::cycles();
+    HAL_StatusTypeDef status = HAL_FLASHEx_Erase(&EraseInitStruct, &erase_error);
+    stats.eraseCycles += trace::cycles() - cycles;
+    trace::end(trace::Event::erase, start / FLASH_ERASE_SIZE);
+    WatchdogReset();
+    HAL_FLASH_Lock();
+    resetCaches();
+    if (status != HAL_OK) {
+        trace::log(trace::Event::flashError, HAL_FLASH_GetError());
         return 1;
     }
-    printf("Erase successful, %lu ms\n", HAL_GetTick() - t0);
 
-    t0 = HAL_GetTick();
-    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_WRPERR | FLASH_FLAG_PGSERR);
+    erasedSectors |= 1UL << sector;
+    ++stats.pagesErased;
+    if (SelfProgram::eraseCount < 0xff)
+        ++SelfProgram::eraseCount;
+    return 0;
+}
 
-    printf("Erasing BANK_2...\n");
-    EraseInitStruct = {
-        .TypeErase = FLASH_TYPEERASE_MASSERASE,
-        .Banks = FLASH_BANK_2,
-        .Sector = 0,
-        .NbSectors = 0,
-        .VoltageRange = FLASH_VOLTAGE_RANGE_3,
-    };
-    if (HAL_FLASHEx_Erase(&EraseInitStruct, &erase_error) != HAL_OK) {
-        printf("Erase failed: %lu\n", erase_error);
-        return 1;
-    }
-    printf("Erase successful, %lu ms\n", HAL_GetTick() - t0);
+void SelfProgram::startErasing() {
+    erasing = true;
+    erasedSectors = 0;
+}
 
-    HAL_FLASH_Unlock();
+uint8_t SelfProgram::eraseSectors(uint32_t address, uint32_t len) {
+    const uint32_t end = address + len;
+    while (erasing && address < end) {
+        uint32_t start, size;
+        uint8_t sector = sectorOf(address, &start, &size);
+        if (!(erasedSectors & (1UL << sector)) && eraseSector(sector, start, size) != 0)
+            return 1;
+        address = start + size;
+    }
     return 0;
 }
 
-/** Sector will be erased by the first write at its beginning(first byte of the
- *  sector). Subsequent writes to the same sector do not need erasing(that would
+uint8_t SelfProgram::finishErasing() {
+    uint8_t err = eraseSectors(0, applicationSize);
+    erasing = false;
+    return err;
+}
+
+/** Single pages cannot be erased, the sectors are larger than a page and of
+ *  mixed sizes. Rewriting the application erases them with eraseSectors().
+ **/
+uint8_t SelfProgram::erasePage(uint32_t) {
+    return 1;
+}
+
+/** Sector will be erased by the first write to it (see eraseSectors()).
+ *  Subsequent writes to the same sector do not need erasing(that would
  *  erase already written data).
  *
  *  Assumption is that data is written sequentially, at least within the same
@@ -114,10 +157,10 @@ uint8_t SelfProgram::eraseApplicationFlash() {
  *
  **/
 uint8_t SelfProgram::writePage(uint32_t address, uint8_t *data, uint16_t len) {
-    uint32_t flash_address = application_start + address;
-    printf("SelfProgram::writePage(%08lX, %d)\n", address,  len);
-    printf("Real address: %08lX\n", flash_address);
+    nextWriteGeneration();
 
+    // Locked again on every return, eraseSector() unlocks on its own between
+    // the writes
     HAL_FLASH_Unlock();
     __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_WRPERR | FLASH_FLAG_PGSERR);
 
@@ -134,9 +177,9 @@ uint8_t SelfProgram::writePage(uint32_t address, uint8_t *data, uint16_t len) {
         uint32_t current_flash_address = application_start + address + i;
         WatchdogReset();
         if ((err = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, current_flash_address, batch)) != HAL_OK) {
-            printf("Write failed(batch=%d)\n", batch_size);
-            printf("Address: %08lX, Data: %08lX\n", current_flash_address, batch);
-            report_error(err);
+            trace::log(trace::Event::flashError, HAL_FLASH_GetError());
+            HAL_FLASH_Lock();
+            resetCaches();
             return 1;
         }
     }
@@ -146,21 +189,13 @@ uint8_t SelfProgram::writePage(uint32_t address, uint8_t *data, uint16_t len) {
         uint32_t current_flash_address = application_start + address + i;
         WatchdogReset();
         if ((err = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, current_flash_address, byte)) != HAL_OK) {
-            printf("Write failed(byte)\n");
-            printf("Address: %08lX, Data: %02X\n", current_flash_address, byte);
-            report_error(err);
+            trace::log(trace::Event::flashError, HAL_FLASH_GetError());
+            HAL_FLASH_Lock();
+            resetCaches();
             return 1;
         }
     }
     HAL_FLASH_Lock();
-
-    // Invalidate the instruction & data cache
-    __HAL_FLASH_DATA_CACHE_DISABLE();
-    __HAL_FLASH_INSTRUCTION_CACHE_DISABLE();
-    __HAL_FLASH_DATA_CACHE_RESET();
-    __HAL_FLASH_INSTRUCTION_CACHE_RESET();
-    __HAL_FLASH_INSTRUCTION_CACHE_ENABLE();
-    __HAL_FLASH_DATA_CACHE_ENABLE();
-    printf("Write successful\n");
+    resetCaches();
     return 0;
 }
@@ -5,6 +5,13 @@
 #include <stm32h5xx_ll_system.h>
 #include <stm32h5xx_ll_utils.h>
 
+// ClockInit() runs from HSI/2 (64 MHz / 2 = 32 MHz) at voltage scale 3.
+// Boosted, PLL1 runs from the same 32 MHz: /4 * 60 = 480 MHz VCO, /2 =
+// 240 MHz, which needs voltage scale 0, 5 wait states and the matching flash
+// programming delay
+static const uint32_t BASE_CLOCK_HZ = 32000000;
+static const uint32_t BOOST_CLOCK_HZ = 240000000;
+
 void ClockInit() {
     LL_FLASH_SetLatency(LL_FLASH_LATENCY_3);
     while(LL_FLASH_GetLatency()!= LL_FLASH_LATENCY_3) { }
@@ -27,11 +34,57 @@ void ClockInit() {
     LL_RCC_SetAPB1Prescaler(LL_RCC_APB1_DIV_1);
     LL_RCC_SetAPB2Prescaler(LL_RCC_APB2_DIV_1);
     LL_RCC_SetAPB3Prescaler(LL_RCC_APB3_DIV_1);
-    LL_SetSystemCoreClock(64000000);
+    LL_SetSystemCoreClock(BASE_CLOCK_HZ);
 
      /* Update the time base */
     HAL_InitTick (TICK_INT_PRIORITY);
 }
 
+uint32_t ClockBoost(bool boost) {
+    const bool boosted = LL_RCC_GetSysClkSource() == LL_RCC_SYS_CLKSOURCE_STATUS_PLL1;
+    if (boost == boosted)
+        return 0;
+
+    if (boost) {
+        // Regulator and flash go first, then the clock
+        LL_PWR_SetRegulVoltageScaling(LL_PWR_REGU_VOLTAGE_SCALE0);
+        while (LL_PWR_IsActiveFlag_VOS() == 0) { }
+        LL_FLASH_SetLatency(LL_FLASH_LATENCY_5);
+        MODIFY_REG(FLASH->ACR, FLASH_ACR_WRHIGHFREQ, FLASH_ACR_WRHIGHFREQ_1);
+        while (LL_FLASH_GetLatency() != LL_FLASH_LATENCY_5) { }
+
+        LL_RCC_PLL1_SetSource(LL_RCC_PLL1SOURCE_HSI);
+        LL_RCC_PLL1_SetVCOInputRange(LL_RCC_PLLINPUTRANGE_8_16);
+        LL_RCC_PLL1_SetVCOOutputRange(LL_RCC_PLLVCORANGE_WIDE);
+        LL_RCC_PLL1_SetM(4);
+        LL_RCC_PLL1_SetN(60);
+        LL_RCC_PLL1_SetP(2);
+        LL_RCC_PLL1P_Enable();
+        LL_RCC_PLL1_Enable();
+        while (LL_RCC_PLL1_IsReady() != 1) { }
+
+        LL_RCC_SetSysClkSource(LL_RCC_SYS_CLKSOURCE_PLL1);
+        while (LL_RCC_GetSysClkSource() != LL_RCC_SYS_CLKSOURCE_STATUS_PLL1) { }
+        LL_SetSystemCoreClock(BOOST_CLOCK_HZ);
+    } else {
+        // The clock goes first, then flash and regulator
+        LL_RCC_SetSysClkSource(LL_RCC_SYS_CLKSOURCE_HSI);
+        while (LL_RCC_GetSysClkSource() != LL_RCC_SYS_CLKSOURCE_STATUS_HSI) { }
+        LL_RCC_PLL1_Disable();
+        while (LL_RCC_PLL1_IsReady() != 0) { }
+        LL_SetSystemCoreClock(BASE_CLOCK_HZ);
+
+        LL_FLASH_SetLatency(LL_FLASH_LATENCY_3);
+        MODIFY_REG(FLASH->ACR, FLASH_ACR_WRHIGHFREQ, FLASH_ACR_WRHIGHFREQ_0);
+        while (LL_FLASH_GetLatency() != LL_FLASH_LATENCY_3) { }
+        LL_PWR_SetRegulVoltageScaling(LL_PWR_REGU_VOLTAGE_SCALE3);
+        while (LL_PWR_IsActiveFlag_VOS() == 0) { }
+    }
+
+    /* Update the time base */
+    HAL_InitTick(TICK_INT_PRIORITY);
+    return SystemCoreClock;
+}
+
 void ClockDeinit() {
 }
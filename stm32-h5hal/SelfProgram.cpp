@@ -4,9 +4,19 @@
 
 #include <cstring>
 #include "iwdg.hpp"
+#include "trace.hpp"
 
-uint8_t SelfProgram::writePage(uint32_t address, uint8_t *data, uint16_t len) {
-    static constexpr size_t WRITE_SPEED = 4 * 4; // Word is 32-bit (4 bytes) long
+// The application is written in place. The H503 has two 64K banks, but
+// the bootloader occupies the start of bank 1 and the application (with
+// its descriptor at the end of bank 2) spans both, so there is no bank
+// to stage a new image in and swap to (SWAP_BANK would also map away the
+// bootloader). An interrupted update is caught by the fingerprint: the
+// bootloader stays in control until a complete image is uploaded again.
+static_assert(FLASH_APP_OFFSET + APPLICATION_SIZE > FLASH_BANK_SIZE,
+              "The application fits one bank, consider staging updates in the other");
+
+uint8_t SelfProgram::erasePage(uint32_t address) {
+    nextWriteGeneration();
 
     HAL_FLASH_Unlock();
     __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_WRPERR | FLASH_FLAG_PGSERR);
@@ -24,9 +34,25 @@ uint8_t SelfProgram::writePage(uint32_t address, uint8_t *data, uint16_t len) {
 
     uint32_t erase_error;
     if (HAL_FLASHEx_Erase(&EraseInitStruct, &erase_error) != HAL_OK) {
+        trace::log(trace::Event::flashError, HAL_FLASH_GetError());
+        HAL_FLASH_Lock();
         return 1;
     }
 
+    HAL_FLASH_Lock();
+    LL_ICACHE_Invalidate();
+    return 0;
+}
+
+uint8_t SelfProgram::writePage(uint32_t address, uint8_t *data, uint16_t len) {
+    static constexpr size_t WRITE_SPEED = 4 * 4; // Word is 32-bit (4 bytes) long
+    static_assert(WRITE_SPEED == programSize, "FLASH_PROGRAM_SIZE does not match the program width");
+
+    nextWriteGeneration();
+
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_WRPERR | FLASH_FLAG_PGSERR);
+
     for (size_t i = 0; i < (len / WRITE_SPEED); ++i) {
         uint32_t flash_addr = address + (i * WRITE_SPEED) + FLASH_BASE + FLASH_APP_OFFSET;
         uint32_t data_addr = (uint32_t)(&data[i * WRITE_SPEED]);
@@ -34,18 +60,24 @@ uint8_t SelfProgram::writePage(uint32_t address, uint8_t *data, uint16_t len) {
         WatchdogReset();
 
         if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_QUADWORD, flash_addr, data_addr) != HAL_OK) {
-              return 1;
+            trace::log(trace::Event::flashError, HAL_FLASH_GetError());
+            HAL_FLASH_Lock();
+            return 1;
         }
     }
     if (len % WRITE_SPEED != 0) {
+        // Pad with the erased value, so the rest of the quadword looks
+        // untouched
         uint8_t bytes[WRITE_SPEED];
-        memset(bytes, 0, WRITE_SPEED);
-        memcpy(bytes, data, len % WRITE_SPEED);
+        memset(bytes, 0xff, WRITE_SPEED);
+        memcpy(bytes, &data[(len / WRITE_SPEED) * WRITE_SPEED], len % WRITE_SPEED);
 
         uint32_t flash_addr = address + ((len / WRITE_SPEED) * WRITE_SPEED) + FLASH_BASE + FLASH_APP_OFFSET;
         uint32_t data_addr = (uint32_t)(&bytes);
 
         if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_QUADWORD, flash_addr, data_addr) != HAL_OK) {
+            trace::log(trace::Event::flashError, HAL_FLASH_GetError());
+            HAL_FLASH_Lock();
             return 1;
         }
     }
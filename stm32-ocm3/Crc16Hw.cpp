@@ -0,0 +1,24 @@
+#include "../Crc.h"
+#include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/rcc.h>
+
+// CRC-16/MODBUS on the CRC peripheral: polynomial 0x8005, input
+// reflected per byte, output reflected. The clock is only enabled while
+// calculating. Gating the clock keeps POL, INIT and CR, so the peripheral
+// is reset before, and the application finds it the way it left reset.
+uint16_t crc16IbmUpdateHw(uint16_t crc, const uint8_t *buf, uint8_t len) {
+	rcc_periph_clock_enable(RCC_CRC);
+
+	CRC_POL = 0x8005;
+	CRC_INIT = crc16Reverse(crc);
+	CRC_CR = CRC_CR_POLYSIZE_16 | CRC_CR_REV_IN_BYTE | CRC_CR_REV_OUT | CRC_CR_RESET;
+	while (len > 0) {
+		MMIO8(CRC_BASE) = *buf++; // Byte access, so only 8 bits are fed
+		--len;
+	}
+	crc = CRC_DR;
+
+	rcc_periph_reset_pulse(RST_CRC);
+	rcc_periph_clock_disable(RCC_CRC);
+	return crc;
+}
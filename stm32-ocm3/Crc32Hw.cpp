@@ -0,0 +1,28 @@
+#include "../Crc.h"
+#include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/rcc.h>
+
+#include <cstring>
+
+// CRC-32/MPEG-2 on the CRC peripheral, in the configuration it comes out
+// of reset with. crc16IbmUpdateHw() changes that, so it is set up again.
+// The clock is only enabled while calculating, and the peripheral is reset
+// before it goes off (gating the clock keeps POL, INIT and CR).
+uint32_t crc32Hw(const uint8_t *buf, uint32_t len) {
+	rcc_periph_clock_enable(RCC_CRC);
+
+	CRC_POL = 0x04C11DB7;
+	CRC_INIT = 0xFFFFFFFF;
+	CRC_CR = CRC_CR_RESET;
+	for (uint32_t i = 0; i < len; i += 4) {
+		// Unaligned buffers are fine, a partial last word is padded
+		uint32_t word = 0xFFFFFFFF;
+		memcpy(&word, buf + i, len - i < 4 ? len - i : 4);
+		CRC_DR = word;
+	}
+	uint32_t crc = CRC_DR;
+
+	rcc_periph_reset_pulse(RST_CRC);
+	rcc_periph_clock_disable(RCC_CRC);
+	return crc;
+}
@@ -21,10 +21,9 @@
 #include <stdio.h>
 #include "../Bus.h"
 #include "../BaseProtocol.h"
+#include "../stats.hpp"
+#include "../trace.hpp"
 
-static const uint32_t BAUD_RATE = 230400;
-static const uint32_t MAX_INTER_FRAME = 150; // us
-static const uint32_t INTER_FRAME_BITS = (MAX_INTER_FRAME * BAUD_RATE + 1e6 - 1) / 1e6;
 
 #if defined(BOARD_TYPE_prusa_dwarf)
 	#define RS485_USART USART1
@@ -47,14 +46,14 @@ void BusInit() {
 	rcc_periph_clock_enable(RCC_RS485_USART);
 
 	/* Setup USART parameters. */
-	usart_set_baudrate(RS485_USART, BAUD_RATE);
+	usart_set_baudrate(RS485_USART, BUS_DEFAULT_BAUD_RATE);
 	usart_set_databits(RS485_USART, 8);
 	usart_set_parity(RS485_USART, USART_PARITY_NONE);
 	usart_set_stopbits(RS485_USART, USART_CR2_STOPBITS_1);
 
 	usart_set_mode(RS485_USART, USART_MODE_TX_RX);
 
-	usart_set_rx_timeout_value(RS485_USART, INTER_FRAME_BITS);
+	usart_set_rx_timeout_value(RS485_USART, BusInterFrameBits(BUS_DEFAULT_BAUD_RATE));
 	usart_enable_rx_timeout(RS485_USART);
 
 
@@ -113,6 +112,8 @@ static uint8_t busBuffer[MAX_PACKET_LENGTH];
 static uint8_t busBufferLen = 0;
 static uint8_t busTxPos = 0;
 static uint8_t busAddress = 0;
+// More bytes came than fit busBuffer, the frame is dropped
+static bool busOverflow = false;
 static_assert(MAX_PACKET_LENGTH < (1 << (sizeof(busBufferLen) * 8)), "Code needs changes for bigger packets");
 
 enum State {
@@ -124,7 +125,56 @@ enum State {
 static State busState = StateIdle;
 
 static bool matchAddress(uint8_t address) {
-	return address == getConfiguredAddress();
+	return address == getConfiguredAddress() || address == BROADCAST_ADDRESS;
+}
+
+static uint32_t busBaudRate = BUS_DEFAULT_BAUD_RATE;
+static uint32_t busNextBaudRate = 0;     ///< Rate to switch to once the reply is sent
+static uint32_t busFallbackBaudRate = 0; ///< Rate to restore unless a frame is confirmed in time
+// Cycle count at the switch. SysTick is the cycle counter behind
+// trace::cycles() (see TraceClock.cpp), so it is left alone here.
+static uint32_t busFallbackStart = 0;
+
+static void setBaudRate(uint32_t baud) {
+	// BRR can only be written with the USART disabled
+	usart_disable(RS485_USART);
+	usart_set_baudrate(RS485_USART, baud);
+	usart_set_rx_timeout_value(RS485_USART, BusInterFrameBits(baud));
+	usart_enable(RS485_USART);
+	busBaudRate = baud;
+}
+
+bool BusSetBaudRate(uint32_t baud) {
+	if (baud < BUS_MIN_BAUD_RATE || baud > rcc_apb1_frequency / 16)
+		return false;
+	busNextBaudRate = baud;
+	return true;
+}
+
+void BusConfirmBaudRate() {
+	busFallbackBaudRate = 0;
+}
+
+// Switch rates once the last byte of the reply is out
+static void replySent() {
+	if (!busNextBaudRate)
+		return;
+
+	while (!(USART_ISR(RS485_USART) & USART_ISR_TC)) {}
+	busFallbackBaudRate = busBaudRate;
+	busFallbackStart = trace::cycles();
+	setBaudRate(busNextBaudRate);
+	busNextBaudRate = 0;
+}
+
+// Restore the previous rate if the master did not follow
+static void checkBaudRateFallback() {
+	if (!busFallbackBaudRate)
+		return;
+	if (trace::cycles() - busFallbackStart >= BUS_BAUD_FALLBACK_MS * (rcc_ahb_frequency / 1000)) {
+		setBaudRate(busFallbackBaudRate);
+		BusConfirmBaudRate();
+	}
 }
 
 bool BusUpdate() {
@@ -158,6 +208,7 @@ bool BusUpdate() {
 				gpio_clear(GPIOD, GPIO6); // TE low to enable receive
 			#endif
 			busState = StateIdle;
+			replySent();
 		}
 		// TODO: Clear error flags and/or RTOF after TX?
 	} else if (isr & USART_ISR_RXNE && busState != StateWrite) { // Received data
@@ -170,10 +221,12 @@ bool BusUpdate() {
 			busAddress = data;
 			busState = StateRead;
 			busBufferLen = 0;
+			busOverflow = false;
 		} else if (busBufferLen < sizeof(busBuffer)) {
 			busBuffer[busBufferLen++] = data;
-		} else {
+		} else if (!busOverflow) {
 			printf("rx ovf\n");
+			busOverflow = true;
 		}
 	}
 	if ((isr & (USART_ISR_RTOF)) && busState == StateRead) {
@@ -202,8 +255,13 @@ bool BusUpdate() {
 		bool matched = matchAddress(busAddress);
 		printf("address 0x%x %smatched\n", busAddress, matched ? "" : "not ");
 
+		if (!rxok)
+			++stats.lineErrors;
+		else if (busOverflow && matched)
+			++stats.framesLost;
+
 		// RX addressed to us, execute the callback and setup for a read.
-		if (!rxok || busBufferLen == 0 || !matched) {
+		if (!rxok || busOverflow || busBufferLen == 0 || !matched) {
 			busBufferLen = 0;
 		} else {
 			busBufferLen = BusCallback(busAddress, busBuffer, busBufferLen, sizeof(busBuffer));
@@ -215,6 +273,9 @@ bool BusUpdate() {
 			busState = StateIdle;
 		}
 	}
+	if (busState == StateIdle)
+		checkBaudRateFallback();
+
 	if (busState == StateWrite) {
 		USART_CR1(RS485_USART) |= USART_CR1_TXEIE;
 		USART_CR1(RS485_USART) &= ~(USART_CR1_RXNEIE | USART_CR1_RTOIE);
@@ -16,6 +16,7 @@
  */
 
 #include "SelfProgram.h"
+#include "trace.hpp"
 
 #include <libopencm3/stm32/flash.h>
 
@@ -26,6 +27,10 @@
 #error "Incorrect FLASH_WRITE_SIZE"
 #endif
 
+#if FLASH_PROGRAM_SIZE != FLASH_WRITE_SIZE
+#error "Incorrect FLASH_PROGRAM_SIZE"
+#endif
+
 #if FLASH_ERASE_SIZE % FLASH_WRITE_SIZE != 0
 #error "Incorrect FLASH_ERASE_SIZE"
 #endif
@@ -77,36 +82,12 @@ static void flash_program_row(uint32_t address, uint8_t *data, uint16_t len) {
 	SelfProgram::appFwFingerprintValid = false;
 }
 
-uint8_t SelfProgram::writePage(uint32_t address, uint8_t *data, uint16_t len) {
-	// Can only write to a row boundary
-	if (!len || address % FLASH_WRITE_SIZE != 0 || len > FLASH_WRITE_SIZE) {
-		return 1;
-	}
-
-	// If the address is past the application section don't write anything
-	if (address + len > applicationSize) {
-		return 3;
-	}
-
-	flash_unlock();
-	flash_clear_status_flags();
-
-	// If we are the beginning of a page, erase it
-	if (address % FLASH_ERASE_SIZE == 0) {
-		if (eraseCount < 0xff)
-			++eraseCount;
-		flash_erase_page((address + FLASH_APP_OFFSET) / FLASH_ERASE_SIZE);
-	}
-
-	// If no errors from erase, then program
-	if (FLASH_SR == 0)
-		flash_program_row(address, data, len);
-	flash_lock();
-
-
-	// Get and clear error flags
+// Get and clear the error flags of the last flash operation
+static uint8_t takeFlashErrors() {
 	uint32_t errbits = FLASH_SR & 0xffff;
 	FLASH_SR = 0xffff;
+	if (errbits)
+		trace::log(trace::Event::flashError, errbits);
 
 	// This uses the lower nibble to indicate the first
 	// (least-significant) error bit set, and the upper nibble to
@@ -122,9 +103,47 @@ uint8_t SelfProgram::writePage(uint32_t address, uint8_t *data, uint16_t len) {
 			++res;
 		errbits >>= 1;
 	}
+	return res;
+}
+
+uint8_t SelfProgram::erasePage(uint32_t address) {
+	if (address % FLASH_ERASE_SIZE != 0 || address >= applicationSize) {
+		return 1;
+	}
+
+	nextWriteGeneration();
+
+	flash_unlock();
+	flash_clear_status_flags();
+	flash_erase_page((address + FLASH_APP_OFFSET) / FLASH_ERASE_SIZE);
+	flash_lock();
 
 	// Invalidate fingerprint as the flash has just changed
 	SelfProgram::appFwFingerprintValid = false;
 
-	return res;
+	return takeFlashErrors();
+}
+
+uint8_t SelfProgram::writePage(uint32_t address, uint8_t *data, uint16_t len) {
+	// Can only write to a row boundary
+	if (!len || address % FLASH_WRITE_SIZE != 0 || len > FLASH_WRITE_SIZE) {
+		return 1;
+	}
+
+	// If the address is past the application section don't write anything
+	if (address + len > applicationSize) {
+		return 3;
+	}
+
+	nextWriteGeneration();
+
+	flash_unlock();
+	flash_clear_status_flags();
+	flash_program_row(address, data, len);
+	flash_lock();
+
+	// Invalidate fingerprint as the flash has just changed
+	SelfProgram::appFwFingerprintValid = false;
+
+	return takeFlashErrors();
 }
@@ -0,0 +1,37 @@
+#include "../trace.hpp"
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/stm32/rcc.h>
+
+// The Cortex-M0+ has no cycle counter, so SysTick counts down over 24
+// bits and its interrupt counts the wraps. Stopped again before the
+// application starts, which still has our vector table at first.
+static volatile uint32_t wraps = 0;
+
+void sys_tick_handler() {
+	++wraps;
+}
+
+uint32_t trace::startCycles() {
+	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
+	systick_set_reload(0xffffff);
+	systick_clear();
+	systick_interrupt_enable();
+	systick_counter_enable();
+	return rcc_ahb_frequency / 1000000;
+}
+
+void trace::stopCycles() {
+	systick_interrupt_disable();
+	systick_counter_disable();
+}
+
+uint32_t trace::cycles() {
+	uint32_t n, value;
+	do {
+		n = wraps;
+		value = systick_get_value();
+	} while (n != wraps);
+	return (n << 24) + (0xffffff - value);
+}
@@ -0,0 +1,44 @@
+#include "backup_registers.hpp"
+
+#include <libopencm3/stm32/pwr.h>
+#include <libopencm3/stm32/rcc.h>
+
+// TAMP_BKP1R..4R of the five. The clocks and the write access are only
+// enabled around the access, then put back the way they were.
+#define TAMP_BKPR(index) MMIO32(TAMP_BASE + 0x100 + 4 * (index))
+
+// PWR for the write access, RTCAPB for TAMP
+static const uint32_t clocks = RCC_APBENR1_RTCAPBEN | RCC_APBENR1_PWREN;
+
+struct Access {
+	uint32_t clocks;
+	bool write;
+};
+
+static Access enable_access() {
+	Access previous = { RCC_APBENR1 & clocks, false };
+	RCC_APBENR1 |= clocks;
+	(void)RCC_APBENR1; // dummy read to enforce delay
+	previous.write = (PWR_CR1 & PWR_CR1_DBP) != 0;
+	PWR_CR1 |= PWR_CR1_DBP;
+	return previous;
+}
+
+static void restore_access(Access previous) {
+	if (!previous.write)
+		PWR_CR1 &= ~PWR_CR1_DBP;
+	RCC_APBENR1 &= ~(clocks & ~previous.clocks);
+}
+
+uint32_t read_backup_register(uint8_t index) {
+	const Access previous = enable_access();
+	uint32_t value = TAMP_BKPR(1 + index);
+	restore_access(previous);
+	return value;
+}
+
+void write_backup_register(uint8_t index, uint32_t value) {
+	const Access previous = enable_access();
+	TAMP_BKPR(1 + index) = value;
+	restore_access(previous);
+}
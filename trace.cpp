@@ -0,0 +1,59 @@
+#include "trace.hpp"
+
+#if defined(TRACE_ENABLED)
+
+// Enough for the events of the busiest command (a WRITE_FLASH that
+// commits a page in FLASH_WRITE_SIZE pieces) until the main loop drains
+// them
+static trace::Record ring[64];
+static uint8_t head = 0;
+static uint8_t tail = 0;
+static uint32_t dropped = 0;
+
+static_assert((sizeof(ring) / sizeof(ring[0]) & (sizeof(ring) / sizeof(ring[0]) - 1)) == 0, "Ring size must be a power of two");
+static const uint8_t ringMask = sizeof(ring) / sizeof(ring[0]) - 1;
+
+static bool put(trace::Event event, uint8_t flags, uint32_t arg, uint32_t cycles) {
+    const uint8_t next = (head + 1) & ringMask;
+    if (next == tail)
+        return false;
+    trace::Record &r = ring[head];
+    r.cycles = cycles;
+    r.arg = arg;
+    r.event = static_cast<uint8_t>(event) | flags;
+    r.reserved[0] = r.reserved[1] = r.reserved[2] = 0;
+    head = next;
+    return true;
+}
+
+uint32_t trace::init() {
+    head = tail = 0;
+    dropped = 0;
+    const uint32_t perUs = startCycles();
+    put(Event::clock, 0, perUs, cycles());
+    return perUs;
+}
+
+void trace::deinit() {
+    stopCycles();
+}
+
+void trace::record(Event event, uint8_t flags, uint32_t arg) {
+    const uint32_t now = cycles();
+    // Tell the decoder about a gap first, so it drops the events whose
+    // begin or end went missing
+    if (dropped && put(Event::dropped, 0, dropped, now))
+        dropped = 0;
+    if (dropped || !put(event, flags, arg, now))
+        ++dropped;
+}
+
+bool trace::take(Record &record) {
+    if (tail == head)
+        return false;
+    record = ring[tail];
+    tail = (tail + 1) & ringMask;
+    return true;
+}
+
+#endif
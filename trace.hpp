@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+
+/// Timestamped begin and end events of what the bootloader spends its
+/// time on, and single events in place of log messages, for
+/// trace_decode.py to turn into latency histograms and a readable log.
+///
+/// Only built with TRACE_ENABLED (cmake -DTRACE=ON), otherwise all but the
+/// cycle counter compiles to nothing. The records wait in a small ring
+/// until the main loop copies them to the RTT trace channel
+/// (rtt::drainTrace()), dropping them when it is full rather than
+/// waiting, so recording costs a few dozen cycles and can stay in
+/// production builds. Everything runs from the main loop (BusCallback
+/// included), so the ring needs no locking.
+namespace trace {
+
+enum class Event : uint8_t {
+    clock,          ///< Once at init(), arg: CPU cycles per microsecond
+    bus,            ///< BusCallback, arg: command (0xffff without one)
+    command,        ///< processCommand, arg: command
+    commit,         ///< commitToFlash, arg: page
+    erase,          ///< Erase of a page (STM32F4: sector), arg: page (first of the sector)
+    program,        ///< Programming part of a page, arg: page
+    fingerprint,    ///< calculateFingerprint, arg: 1 if salted
+    hash,           ///< Hashing flash, arg: length / 64
+    dropped,        ///< Records lost to a full ring before this one, arg: count
+    // Single events (see log())
+    crcError,       ///< BusCallback dropped a frame, arg: its length
+    verifyFailed,   ///< A page read back wrong, arg: its address
+    flashError,     ///< Erasing or programming failed, arg: the backend's error flags
+    baud,           ///< SET_BAUD switches the bus, arg: baud rate
+    boost,          ///< ClockBoost() switched the clock, arg: CPU cycles per microsecond from now on
+};
+
+/// Set in Record::event for the end of an event
+static const uint8_t endFlag = 0x80;
+
+/// One record, as it goes out on the trace channel (little endian)
+struct Record {
+    uint32_t cycles;    ///< CPU cycles, modulo 2^32
+    uint32_t arg;
+    uint8_t event;      ///< Event, with endFlag at the end
+    uint8_t reserved[3];
+};
+static_assert(sizeof(Record) == 12, "trace_decode.py expects 12 byte records");
+
+/// Free-running CPU cycle counter, implemented by the backend: DWT
+/// CYCCNT, or SysTick on the Cortex-M0+ parts that have no DWT counter.
+/// startCycles() returns the cycles per microsecond. Always there, as
+/// GET_STATS counts cycles too.
+uint32_t startCycles();
+void stopCycles();
+uint32_t cycles();
+
+#if defined(TRACE_ENABLED)
+
+/// Start the cycle counter and record Event::clock, returns the cycles per
+/// microsecond
+uint32_t init();
+/// Stop the cycle counter before the application starts
+void deinit();
+void record(Event event, uint8_t flags, uint32_t arg);
+/// Take the oldest record, false if there is none
+bool take(Record &record);
+
+#else
+
+inline uint32_t init() { return startCycles(); }
+inline void deinit() { stopCycles(); }
+inline void record(Event, uint8_t, uint32_t) {}
+
+#endif
+
+inline void begin(Event event, uint32_t arg) { record(event, 0, arg); }
+inline void end(Event event, uint32_t arg) { record(event, endFlag, arg); }
+/// Record an event without duration, instead of printing a message
+inline void log(Event event, uint32_t arg) { record(event, 0, arg); }
+
+/// Records the begin of an event now and its end when going out of scope
+class Scope {
+public:
+    Scope(Event event, uint32_t arg) : event(event), arg(arg) { begin(event, arg); }
+    ~Scope() { end(event, arg); }
+
+private:
+    Event event;
+    uint32_t arg;
+};
+
+} // namespace trace
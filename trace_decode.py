@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+#
+# Turns the records of the RTT trace channel (see trace.hpp) back into
+# latencies: a summary and a histogram per event and per command, for
+# each board, or with --log into a readable log with timestamps. Records
+# come from the bootloader built with -DTRACE=ON, e.g. JLinkRTTLogger
+# -RTTChannel 1, or from the simulator's --trace option.
+
+import struct
+import sys
+
+EVENTS = ['clock', 'bus', 'command', 'commit', 'erase', 'program', 'fingerprint', 'hash', 'dropped',
+          'crcError', 'verifyFailed', 'flashError', 'baud', 'boost']
+# Events without duration, trace::log()
+SINGLE = {'clock', 'dropped', 'crcError', 'verifyFailed', 'flashError', 'baud', 'boost'}
+END = 0x80
+RECORD = struct.Struct('<IIB3x')
+
+# Commands and ProtocolCommands in bootloader.cpp and BaseProtocol.h
+COMMANDS = {
+    0x00: 'GET_PROTOCOL_VERSION',
+    0x01: 'SET_ADDRESS',
+    0x03: 'GET_HARDWARE_INFO',
+    0x05: 'START_APPLICATION',
+    0x06: 'WRITE_FLASH',
+    0x07: 'FINALIZE_FLASH',
+    0x08: 'READ_FLASH',
+    0x0c: 'GET_MAX_PACKET_LENGTH',
+    0x0e: 'GET_FINGERPRINT',
+    0x0f: 'COMPUTE_FINGERPRINT',
+    0x10: 'READ_OTP',
+    0x11: 'WRITE_FLASH_STREAM',
+    0x12: 'WRITE_FLASH_LZ4',
+    0x13: 'WRITE_FLASH_DELTA',
+    0x14: 'GET_PAGE_HASHES',
+    0x15: 'SET_BAUD',
+    0x16: 'GET_WRITE_STATUS',
+    0x17: 'GET_STATS',
+}
+
+
+def read_records(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    usable = len(data) - len(data) % RECORD.size
+    return RECORD.iter_unpack(data[:usable])
+
+
+def event_name(event):
+    kind = event & ~END
+    return EVENTS[kind] if kind < len(EVENTS) else f'event {kind}'
+
+
+def latencies(records):
+    """Yields (name, cycles) per completed event, and the cycles per us."""
+    per_us = None
+    open_events = {}
+    for cycles, arg, event in records:
+        kind = event & ~END
+        name = event_name(event)
+        if name == 'clock':
+            per_us = arg
+            open_events.clear()
+            continue
+        if name == 'boost':
+            # Events still open straddle the switch and come out a bit off
+            per_us = arg
+            continue
+        if name == 'dropped':
+            # Begins or ends went missing, so none of the open ones can
+            # be trusted
+            open_events.clear()
+            continue
+        if name in SINGLE:
+            continue
+        if name in ('bus', 'command'):
+            name = f'{name} {COMMANDS.get(arg, hex(arg))}'
+        if not event & END:
+            open_events[(kind, arg)] = cycles
+        elif (kind, arg) in open_events:
+            yield name, (cycles - open_events.pop((kind, arg))) & 0xFFFFFFFF, per_us
+
+
+def histogram(values_us):
+    """Power of two buckets, in microseconds."""
+    buckets = {}
+    for v in values_us:
+        bucket = 1
+        while bucket < v:
+            bucket *= 2
+        buckets[bucket] = buckets.get(bucket, 0) + 1
+    return sorted(buckets.items())
+
+
+def report(board, path):
+    per_event = {}
+    per_us = 1
+    for name, cycles, clock in latencies(read_records(path)):
+        per_us = clock or per_us
+        per_event.setdefault(name, []).append(cycles / per_us)
+
+    print(f'== {board} ({per_us} cycles/us)')
+    print(f'{"event":<32} {"count":>7} {"min us":>10} {"median":>10} {"p99":>10} {"max":>10} {"total ms":>10}')
+    for name in sorted(per_event):
+        values = sorted(per_event[name])
+        n = len(values)
+        print(f'{name:<32} {n:7} {values[0]:10.1f} {values[n // 2]:10.1f} '
+              f'{values[min(n - 1, n * 99 // 100)]:10.1f} {values[-1]:10.1f} {sum(values) / 1000:10.1f}')
+    for name in sorted(per_event):
+        print(f'\n{name}')
+        buckets = histogram(per_event[name])
+        most = max(count for _, count in buckets)
+        for bucket, count in buckets:
+            bar = '#' * max(1, count * 40 // most)
+            print(f'  <= {bucket:>8} us {count:7} {bar}')
+    print()
+
+
+def describe(name, arg):
+    if name in ('bus', 'command'):
+        return COMMANDS.get(arg, hex(arg))
+    if name in ('commit', 'erase', 'program'):
+        return f'page {arg}'
+    if name == 'fingerprint':
+        return 'salted' if arg else 'unsalted'
+    if name == 'hash':
+        return f'{arg * 64} bytes'
+    if name in ('clock', 'boost'):
+        return f'{arg} cycles/us'
+    if name == 'crcError':
+        return f'{arg} bytes'
+    if name in ('verifyFailed', 'flashError'):
+        return f'0x{arg:08x}'
+    return str(arg)
+
+
+def log(board, path):
+    """One line per record, with the time since the clock record."""
+    per_us = 1
+    elapsed_us = 0
+    last = None
+    for cycles, arg, event in read_records(path):
+        name = event_name(event)
+        if name == 'clock':
+            per_us = arg or 1
+            elapsed_us = 0
+        elif last is not None:
+            elapsed_us += ((cycles - last) & 0xFFFFFFFF) / per_us
+        if name == 'boost':
+            per_us = arg or 1
+        last = cycles
+        if name in SINGLE:
+            what = name
+        else:
+            what = f'{name} {"end" if event & END else "begin"}'
+        print(f'{board} {elapsed_us:14.1f} us  {what:<20} {describe(name, arg)}')
+
+
+def main(argv):
+    args = argv[1:]
+    show_log = '--log' in args
+    args = [arg for arg in args if arg != '--log']
+    if not args:
+        print(f'usage: {argv[0]} [--log] [<board>=]<trace.bin>...')
+        return 1
+
+    for arg in args:
+        board, _, path = arg.rpartition('=')
+        if show_log:
+            log(board or path, path)
+        else:
+            report(board or path, path)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))